@@ -0,0 +1,64 @@
+#ifndef _ASYNC_STALENESS_MASTER_NN_
+#define _ASYNC_STALENESS_MASTER_NN_
+
+#include "distributed_defines.h"
+#include "sync_replicas_master_nn.h"
+
+// Stale synchronous parallel master. Gradients are applied as soon as
+// they arrive, as long as they were computed on weights at most
+// `staleness` steps old. A new step (weight version) is published once
+// every layer has had n_to_collect gradients applied to it.
+class AsyncStalenessMasterNN : public SyncReplicasMasterNN {
+ public:
+    AsyncStalenessMasterNN(NNParams *params, std::vector<MPI_Comm> &layer_comms, int n_procs, int n_to_collect,
+			   int staleness, bool staleness_aware_lr) :
+	SyncReplicasMasterNN(params, layer_comms, n_procs, n_to_collect,
+			     scheme_name(staleness, staleness_aware_lr)) {
+	this->staleness = staleness;
+	this->staleness_aware_lr = staleness_aware_lr;
+    }
+
+ protected:
+    int staleness;
+    bool staleness_aware_lr;
+
+    static string scheme_name(int staleness, bool staleness_aware_lr) {
+	string name = "AsyncStaleness" + std::to_string(staleness);
+	if (staleness_aware_lr) {
+	    name += "ScaledLR";
+	}
+	return name + "_";
+    }
+
+    // Any gradient within the staleness bound is accepted, as long as a
+    // receive slot is free.
+    bool AcceptGradient(int, int step) override {
+	return cur_step - step <= staleness;
+    }
+
+    // Apply the gradient right away. The step may have advanced since
+    // its header was accepted, so the bound is checked again. A node sum
+    // of count gradients moves the weights as far as count of them.
+    bool ConsumeGradient(int l, int step, double *gradient, int count = 1) override {
+	int gradient_staleness = cur_step - step;
+	if (gradient_staleness > staleness) {
+	    return false;
+	}
+
+	// Each gradient gets 1/n_to_collect of the learning rate, so a
+	// step moves the weights as far as a synchronous one.
+	double lr = learning_rate / n_to_collect;
+	if (staleness_aware_lr) {
+	    lr /= 1 + gradient_staleness;
+	}
+	layers[l]->ApplyGrad(lr, gradient);
+	gradients_accumulated[l] += count;
+	return true;
+    }
+
+    // Gradients have already been applied.
+    void FinishStep() override {
+    }
+};
+
+#endif
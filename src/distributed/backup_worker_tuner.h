@@ -0,0 +1,106 @@
+#ifndef _BACKUP_WORKER_TUNER_
+#define _BACKUP_WORKER_TUNER_
+
+#include "distributed_defines.h"
+
+// Chooses how many gradients the sync master waits for each step.
+//
+// For the last ADAPTIVE_N_TO_COLLECT_WINDOW steps we keep the time (from
+// the step's start) at which each worker finished its backward pass, as
+// seen from its header for layer 0, the last one a worker sends. The
+// k-th of those times is what a step collecting k gradients costs, plus
+// an overhead (transfer, averaging, broadcast) measured from the steps we
+// did run. We pick the k that maximizes k / (t_k + overhead), i.e.
+// samples per second. Workers usually short circuit before reporting, so
+// counts above the ones we ran are rarely observed; when the best known k
+// is also the largest known, we try one more.
+class BackupWorkerTuner {
+ public:
+    BackupWorkerTuner(int min_to_collect, int max_to_collect) {
+	this->min_to_collect = min_to_collect;
+	this->max_to_collect = max_to_collect;
+    }
+
+    void RecordStepStart(int step) {
+	step_start_times[step] = GetTimeMillis();
+	step_arrivals[step] = std::vector<double>();
+    }
+
+    void RecordArrival(int step) {
+	if (step_start_times.find(step) == step_start_times.end()) return;
+	step_arrivals[step].push_back(GetTimeMillis() - step_start_times[step]);
+    }
+
+    // Called once cur_step has been started with RecordStepStart.
+    // Returns the number of gradients to collect for it.
+    int Choose(int cur_step, int n_to_collect) {
+	Prune(cur_step);
+	n_to_collect = ChooseCore(cur_step, n_to_collect);
+	step_n_to_collect[cur_step] = n_to_collect;
+	return n_to_collect;
+    }
+
+ protected:
+    int min_to_collect, max_to_collect;
+    std::map<int, double> step_start_times;
+    std::map<int, int> step_n_to_collect;
+    std::map<int, std::vector<double> > step_arrivals;
+
+    int ChooseCore(int cur_step, int n_to_collect) {
+
+	// Overhead past the last gradient we waited for, averaged over
+	// finished steps for which we saw it arrive.
+	double overhead = 0;
+	int n_overhead = 0;
+	for (auto it = step_start_times.begin(); it != step_start_times.end(); it++) {
+	    int step = it->first;
+	    if (step_start_times.find(step+1) == step_start_times.end()) continue;
+	    std::vector<double> &arrivals = step_arrivals[step];
+	    int k = step_n_to_collect[step];
+	    if (arrivals.size() < k) continue;
+	    std::sort(arrivals.begin(), arrivals.end());
+	    overhead += step_start_times[step+1] - it->second - arrivals[k-1];
+	    n_overhead++;
+	}
+	if (n_overhead < ADAPTIVE_N_TO_COLLECT_WINDOW / 2) {
+	    return n_to_collect;
+	}
+	overhead /= n_overhead;
+
+	int best = n_to_collect, largest_known = 0;
+	double best_rate = 0;
+	for (int k = min_to_collect; k <= max_to_collect; k++) {
+	    double t_k = 0;
+	    int n_seen = 0;
+	    for (auto it = step_arrivals.begin(); it != step_arrivals.end(); it++) {
+		if (it->first == cur_step || it->second.size() < k) continue;
+		std::sort(it->second.begin(), it->second.end());
+		t_k += it->second[k-1];
+		n_seen++;
+	    }
+	    if (n_seen < ADAPTIVE_N_TO_COLLECT_WINDOW / 2) continue;
+	    largest_known = k;
+	    double rate = k / (t_k / n_seen + overhead);
+	    if (rate > best_rate) {
+		best_rate = rate;
+		best = k;
+	    }
+	}
+	if (best == largest_known && best < max_to_collect) {
+	    best++;
+	}
+	return best;
+    }
+
+    void Prune(int cur_step) {
+	while (!step_start_times.empty() &&
+	       step_start_times.begin()->first < cur_step - ADAPTIVE_N_TO_COLLECT_WINDOW) {
+	    int step = step_start_times.begin()->first;
+	    step_start_times.erase(step);
+	    step_n_to_collect.erase(step);
+	    step_arrivals.erase(step);
+	}
+    }
+};
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef _DATASET_SHARD_
+#define _DATASET_SHARD_
+
+#include "distributed_defines.h"
+
+// A worker's disjoint share of a dataset. One reader rank loads and
+// shuffles the whole set once and scatters contiguous shards to the
+// workers, so the set is read once however many ranks there are and a
+// worker holds only its shard. Workers' epochs are passes over their own
+// shard. The evaluator gets an empty shard, and so does the master
+// unless it computes gradients too.
+//
+// Collective over comm.
+class DatasetShard {
+ public:
+    DatasetShard(MPI_Comm comm, int reader_rank, string images_path, string labels_path) {
+	int rank, n_procs;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &n_procs);
+	image_size = IMAGE_X*IMAGE_Y;
+
+	uchar *all_images = NULL, *all_labels = NULL;
+	std::vector<int> counts(n_procs, 0), image_counts(n_procs), displacements(n_procs), image_displacements(n_procs);
+	if (rank == reader_rank) {
+	    int n_total = 0, file_image_size = 0;
+	    uchar **images = read_mnist_images(images_path, n_total, file_image_size);
+	    all_labels = read_mnist_labels(labels_path, n_total);
+	    assert(file_image_size == image_size);
+	    MNISTShuffleDataAndLabels(images, all_labels, n_total);
+
+	    all_images = new uchar[(size_t)n_total * image_size];
+	    for (int i = 0; i < n_total; i++) {
+		memcpy(&all_images[(size_t)i * image_size], images[i], image_size);
+		delete[] images[i];
+	    }
+	    delete[] images;
+
+	    int n_workers = run_config.NWorkers(n_procs), worker = 0;
+	    for (int i = 0; i < n_procs; i++) {
+		if (i == EVALUATOR_RANK || (i == MASTER_RANK && !run_config.master_computes)) continue;
+		counts[i] = n_total / n_workers + (worker < n_total % n_workers ? 1 : 0);
+		worker++;
+	    }
+	}
+
+	MPI_Scatter(counts.data(), 1, MPI_INT, &n_examples, 1, MPI_INT, reader_rank, comm);
+	int offset = 0;
+	for (int i = 0; i < n_procs; i++) {
+	    displacements[i] = offset;
+	    image_displacements[i] = offset * image_size;
+	    image_counts[i] = counts[i] * image_size;
+	    offset += counts[i];
+	}
+
+	data = new uchar[(size_t)n_examples * image_size];
+	labels = new uchar[n_examples];
+	MPI_Scatterv(all_images, image_counts.data(), image_displacements.data(), MPI_UNSIGNED_CHAR,
+		     data, n_examples * image_size, MPI_UNSIGNED_CHAR, reader_rank, comm);
+	MPI_Scatterv(all_labels, counts.data(), displacements.data(), MPI_UNSIGNED_CHAR,
+		     labels, n_examples, MPI_UNSIGNED_CHAR, reader_rank, comm);
+	delete[] all_images;
+	delete[] all_labels;
+
+	// The training code shuffles rows by swapping their contents, so
+	// rows may point into one block.
+	images = new uchar*[n_examples];
+	for (int i = 0; i < n_examples; i++) {
+	    images[i] = &data[(size_t)i * image_size];
+	}
+    }
+
+    ~DatasetShard() {
+	delete[] images;
+	delete[] data;
+	delete[] labels;
+    }
+
+    uchar **images, *labels;
+    int n_examples;
+
+ protected:
+    uchar *data;
+    int image_size;
+};
+
+#endif
@@ -21,22 +21,201 @@
 #define MASTER_RANK 0
 #define EVALUATOR_RANK 1
 #define N_RECV_REQUESTS_PER_LAYER 100
+
+// Tag 0 on a layer communicator is the gradient control channel.
+// Workers send a one int header (the step the gradient was computed
+// for) and the master replies with {accepted, master step} before any
+// gradient data moves. Tags >= STEP_START carry weights and gradients.
+#define GRADIENT_CONTROL_TAG 0
+#define GRADIENT_REJECTED 0
+#define GRADIENT_ACCEPTED 1
+#define GRADIENT_CONSUMED 2   // Already read from shared memory, nothing to send.
+
+// The evaluator sends the last step it evaluated on this tag of
+// MPI_COMM_WORLD, and the master answers with the step of the weights
+// it is about to send. A step >= n_train_iters means training is over.
+#define SNAPSHOT_TAG 1
+
+// Let the sync master choose n_to_collect each step from observed worker
+// arrival times, within [MIN_N_TO_COLLECT, MAX_N_TO_COLLECT] (capped at
+// the number of workers). The choice looks at the last
+// ADAPTIVE_N_TO_COLLECT_WINDOW steps.
+#ifndef ADAPTIVE_N_TO_COLLECT
+#define ADAPTIVE_N_TO_COLLECT false
+#endif
+#define MIN_N_TO_COLLECT 1
+#define MAX_N_TO_COLLECT 1000
+#define ADAPTIVE_N_TO_COLLECT_WINDOW 10
+
+// Evaluate on a fixed random subset of this many examples instead of
+// the whole set, and report 95% confidence intervals. 0 disables it.
+#ifndef EVALUATION_SUBSET_SIZE
+#define EVALUATION_SUBSET_SIZE 0
+#endif
+#define EVALUATION_SUBSET_SEED 1234
+
+// Evaluate snapshots with int8 weights (see quantized_nn.h). Every
+// QUANTIZED_DRIFT_CHECK-th evaluation also runs in double, and the
+// quantized numbers are flagged as drifted when the error rates differ
+// by more than QUANTIZED_MAX_ERROR_DRIFT or the losses by more than
+// QUANTIZED_MAX_LOSS_DRIFT of the double one.
+#ifndef QUANTIZED_EVALUATION
+#define QUANTIZED_EVALUATION false
+#endif
+#ifndef QUANTIZED_DRIFT_CHECK
+#define QUANTIZED_DRIFT_CHECK 10
+#endif
+#define QUANTIZED_MAX_ERROR_DRIFT .005
+#define QUANTIZED_MAX_LOSS_DRIFT .02
+
+// Defaults for settings that can also be given at runtime (see
+// run_config.h).
 #ifndef SHORTCIRCUIT
 #define SHORTCIRCUIT true
 #endif
+#ifndef GENERATE_TIMELINE
 #define GENERATE_TIMELINE false
+#endif
+#ifndef N_TRAIN_ITERS
 #define N_TRAIN_ITERS 100
+#endif
+
+// Staleness bound for the asynchronous master. 0 runs SyncReplicasMasterNN,
+// anything larger runs AsyncStalenessMasterNN.
+#ifndef STALENESS
+#define STALENESS 0
+#endif
+#ifndef STALENESS_AWARE_LR
+#define STALENESS_AWARE_LR true
+#endif
+
+// What a worker does between sending its gradients and the next step.
+// IDLE_SPIN polls MPI continuously, IDLE_BACKOFF sleeps with exponential
+// backoff up to IDLE_BACKOFF_MAX_US between polls and IDLE_BLOCK waits in
+// MPI_Waitany. In all cases the next batch is prepared first.
+#define IDLE_SPIN 0
+#define IDLE_BACKOFF 1
+#define IDLE_BLOCK 2
+#ifndef WORKER_IDLE_POLICY
+#define WORKER_IDLE_POLICY IDLE_BACKOFF
+#endif
+#define IDLE_BACKOFF_MAX_US 1000
+
+// Local SGD. With LOCAL_SGD_STEPS > 1 each worker takes that many local
+// steps per master step and sends its model delta instead of a gradient.
+// LOCAL_SGD_ADAPTIVE lets each worker tune its count between 1 and
+// LOCAL_SGD_MAX_STEPS from how long it idles between rounds.
+#ifndef LOCAL_SGD_STEPS
+#define LOCAL_SGD_STEPS 1
+#endif
+#ifndef LOCAL_SGD_ADAPTIVE
+#define LOCAL_SGD_ADAPTIVE false
+#endif
+#define LOCAL_SGD_MAX_STEPS 32
+
+// Split each node's cores between its ranks, pin them and size BLAS to
+// match (see thread_budget.h). RESERVE_PROGRESS_CORE keeps one core of
+// the node for MPI's own threads.
+#ifndef THREAD_BUDGET
+#define THREAD_BUDGET true
+#endif
+#ifndef RESERVE_PROGRESS_CORE
+#define RESERVE_PROGRESS_CORE false
+#endif
+
+// Time each gemm shape of the network at startup and give each the
+// fastest BLAS thread count within the budget (see gemm_tuner.h).
+#ifndef TUNE_GEMMS
+#define TUNE_GEMMS true
+#endif
+
+// Split the elementwise loops of the layers, batch loading and the
+// master's gradient sums across the rank's cores (see task_pool.h).
+#ifndef PARALLEL_LOOPS
+#define PARALLEL_LOOPS true
+#endif
+
+// Exchange weights and gradients between the master and the workers on
+// its node through an MPI-3 shared memory window (see
+// shared_memory_transport.h).
+#ifndef SHARED_MEMORY_TRANSPORT
+#define SHARED_MEMORY_TRANSPORT true
+#endif
+
+// Announce steps by writing a counter into each worker's memory (see
+// step_notifier.h) instead of sending each a STEP_TAG message.
+#ifndef STEP_NOTIFIER
+#define STEP_NOTIFIER true
+#endif
+
+// Run the parameter server on one-sided communication: workers Get
+// weights from and Accumulate gradients into windows on the master (see
+// rma_parameter_store.h).
+#ifndef RMA_PARAMETER_SERVER
+#define RMA_PARAMETER_SERVER false
+#endif
+
+// Versions of each layer's weights the master keeps to send from (see
+// weight_versions.h). More are added while all are in flight.
+#ifndef N_WEIGHT_VERSIONS
+#define N_WEIGHT_VERSIONS 2
+#endif
+
+// Have the master compute gradients on a shard of its own, on a thread
+// beside the one receiving the workers' (see master_gradient_worker.h).
+// Its polling backs off up to MASTER_POLL_MAX_US while that thread runs.
+#ifndef MASTER_COMPUTES
+#define MASTER_COMPUTES false
+#endif
+#ifndef MASTER_POLL_MAX_US
+#define MASTER_POLL_MAX_US 100
+#endif
+
+// Workers on a node sum their gradients at a node leader, which offers
+// the sum to the master with a count (see node_aggregator.h). A sum
+// waits at most HIERARCHICAL_FLUSH_US for the node's slower workers.
+#ifndef HIERARCHICAL_AGGREGATION
+#define HIERARCHICAL_AGGREGATION false
+#endif
+#ifndef HIERARCHICAL_FLUSH_US
+#define HIERARCHICAL_FLUSH_US 2000
+#endif
+
+#include "run_config.h"
 
 string scheme_full_name(string scheme_name, int n_to_collect, int n_procs) {
 
     // -2 for master and evaluator
     string name = scheme_name + std::to_string(n_to_collect) + "_"  + std::to_string(n_procs-2);
-    if (SHORTCIRCUIT) {
+    if (run_config.shortcircuit) {
 	name += "_shortcircuit";
     }
     else {
 	name += "_no_shortcircuit";
     }
+    if (LOCAL_SGD_STEPS > 1) {
+	name += "_localsgd" + std::to_string(LOCAL_SGD_STEPS);
+	if (LOCAL_SGD_ADAPTIVE) {
+	    name += "_adaptive";
+	}
+    }
+
+    // Injected delays, e.g. "_faults_exponential-20_none_seed1".
+    if (run_config.FaultsInjected()) {
+	string faults = "_faults_" + run_config.compute_delay.Name() + "_" + run_config.message_delay.Name();
+	std::replace(faults.begin(), faults.end(), ':', '-');
+	name += faults;
+	if (run_config.compute_delay.kind == "slow_node" || run_config.message_delay.kind == "slow_node") {
+	    name += "_slow";
+	    for (int i = 0; i < run_config.slow_ranks.size(); i++) {
+		name += "-" + std::to_string(run_config.slow_ranks[i]);
+	    }
+	    if (run_config.slow_ranks.empty()) {
+		name += "-" + std::to_string(n_procs-1);
+	    }
+	}
+	name += "_seed" + std::to_string(run_config.fault_seed);
+    }
     return name;
 }
 
@@ -2,6 +2,11 @@
 #define _EVALUATOR_NN_
 
 #include "distributed_defines.h"
+#include "../nn/quantized_nn.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <random>
 
 class EvaluatorNN : public NN {
  public:
@@ -10,74 +15,143 @@ class EvaluatorNN : public NN {
 	this->n_procs = n_procs;
 	this->cur_step = STEP_UNINITIALIZED;
 	this->comm = MPI_COMM_WORLD;
-	this->next_step = STEP_UNINITIALIZED;
-	this->step_fetch_request = MPI_REQUEST_NULL;
+	this->evaluation_step = STEP_UNINITIALIZED;
+	this->evaluation_done = true;
+	this->last_fetch_millis = this->last_evaluation_millis = 0;
+	this->n_evaluations = 0;
+
+	// Only fully connected networks can be quantized.
+	quantized = NULL;
+	bool fully_connected = true;
+	std::vector<int> dimensions;
+	for (int i = 0; i < layers.size(); i++) {
+	    fully_connected = fully_connected && !params->IsConvolution(i);
+	    dimensions.push_back(layers[i]->Dimension());
+	}
+	if (run_config.quantized_evaluation && fully_connected) {
+	    quantized = new QuantizedNN(batchsize, dimensions);
+	    std::cout << "Evaluating with int8 weights, " << quantized->KernelName() << " kernels" << std::endl;
+	}
+	else if (run_config.quantized_evaluation) {
+	    std::cout << "Evaluating in double: only fully connected networks are quantized" << std::endl;
+	}
 
 	for (int i = 0; i < layers.size(); i++) {
-	    layer_cur_step.push_back(STEP_UNINITIALIZED);
 	    layer_fetch_requests.push_back(MPI_REQUEST_NULL);
 	}
 
+	// Snapshots are received here while the previous one is evaluated.
+	for (int i = 0; i < layers.size()-1; i++) {
+	    double *snapshot;
+	    AllocateMemory(&snapshot, layers[i]->GetLayerCount());
+	    snapshot_buffers.push_back(snapshot);
+	}
+
 	ReceiveMasterSchemeName();
 	time_loss_out.open("outfiles/time_loss_out_" + name);
     }
 
     ~EvaluatorNN() {
 	time_loss_out.close();
+	for (int i = 0; i < snapshot_buffers.size(); i++) {
+	    free(snapshot_buffers[i]);
+	}
+	delete quantized;
     }
 
     void Train(uchar **data, uchar *labels, int n_examples) override {
 
 	time_loss_out << name << std::endl;
 
-	SynchronousFetchStep();
-
-	double start_training_time = GetTimeMillis();
+	ChooseEvaluationSet(data, labels, n_examples);
+	std::thread evaluation_thread(&EvaluatorNN::EvaluationLoop, this);
 
 	while (true) {
-	    AsynchronousFetchStepUpdate();
-	    bool changed = UpdateStep();
-	    AsynchronousFetchWeights();
+	    double fetch_start = GetTimeMillis();
+	    int step = FetchSnapshot();
+	    if (step >= run_config.n_train_iters) break;
+	    if (cur_step == STEP_UNINITIALIZED) {
+		start_training_time = GetTimeMillis();
+	    }
+	    cur_step = step;
+	    last_fetch_millis = GetTimeMillis() - fetch_start;
+	    double snapshot_time = GetTimeMillis() - start_training_time;
 
-	    if (cur_step >= N_TRAIN_ITERS) break;
+	    // Hand the snapshot to the evaluation thread once it is free.
+	    double request_at;
+	    {
+		std::unique_lock<std::mutex> lock(evaluation_mutex);
+		evaluation_cv.wait(lock, [this] { return evaluation_done; });
+		for (int i = 0; i < layers.size()-1; i++) {
+		    memcpy(layers[i]->GetLayer(), snapshot_buffers[i], sizeof(double) * layers[i]->GetLayerCount());
+		}
+		evaluation_step = cur_step;
+		evaluation_time = snapshot_time;
+		evaluation_done = false;
 
-	    if (changed) {
+		// Ask for the next snapshot so that it lands about when this
+		// evaluation finishes; asking earlier would get an older step.
+		request_at = GetTimeMillis() + last_evaluation_millis - last_fetch_millis;
+	    }
+	    evaluation_cv.notify_all();
 
-		// Wait for the synced weight layer to be fetched
-		for (int i = 0; i < layers.size(); i++) {
-		    if (i != layers.size()-1) {
-			MPI_Wait(&layer_fetch_requests[i], MPI_STATUS_IGNORE);
-			layer_cur_step[i] = cur_step;
-		    }
+	    while (GetTimeMillis() < request_at) {
+		{
+		    std::lock_guard<std::mutex> lock(evaluation_mutex);
+		    if (evaluation_done) break;
 		}
-
-		// Evaluate on these weights
-		double loss = ComputeLoss(data, labels, n_examples);
-		double err_rate = ComputeErrorRate(data, labels, n_examples);
-		double time = GetTimeMillis() - start_training_time;
-		time_loss_out << cur_step << " " << time << " " << loss << " " << err_rate << std::endl;
+		usleep(1000);
 	    }
 	}
+
+	{
+	    std::unique_lock<std::mutex> lock(evaluation_mutex);
+	    evaluation_cv.wait(lock, [this] { return evaluation_done; });
+	    evaluation_step = run_config.n_train_iters;
+	    evaluation_done = false;
+	}
+	evaluation_cv.notify_all();
+	evaluation_thread.join();
     }
 
  protected:
 
-    // The synchronized step (should be the same across workers & master)
-    int cur_step, rank, n_procs, next_step;
+    int cur_step, rank, n_procs;
     MPI_Comm comm;
-    MPI_Request step_fetch_request;
     string name;
     ofstream time_loss_out;
-
-    // layer_cur_step[i] is the iteration step for the current weights
-    std::vector<int> layer_cur_step;
+    double start_training_time;
 
     // Requests for fetching each layer.
     std::vector<MPI_Request> layer_fetch_requests;
+    std::vector<double *> snapshot_buffers;
 
     // Layer communicator handles
     std::vector<MPI_Comm> &layer_comms;
 
+    // State shared with the evaluation thread, guarded by evaluation_mutex.
+    std::mutex evaluation_mutex;
+    std::condition_variable evaluation_cv;
+    bool evaluation_done;
+    int evaluation_step;
+    double evaluation_time, last_fetch_millis, last_evaluation_millis;
+
+    // The examples evaluated on, either the whole set or a fixed subset.
+    std::vector<uchar *> evaluation_data;
+    std::vector<uchar> evaluation_labels;
+    int n_total_examples;
+
+    // Int8 copy of the snapshot when run_config.quantized_evaluation is
+    // set, NULL otherwise. Only touched by the evaluation thread.
+    QuantizedNN *quantized;
+    int n_evaluations;
+
+    // Sums over the evaluation set from one forward pass over it.
+    struct EvaluationTotals {
+	double loss, loss_sq, n_wrong;
+	std::vector<int> predictions;
+    };
+
     void ReceiveMasterSchemeName() {
 	MPI_Status stat;
 	MPI_Probe(MASTER_RANK, 0, comm, &stat);
@@ -96,81 +170,148 @@ class EvaluatorNN : public NN {
 	free(name_holder);
     }
 
-    int NewStepQueued() {
-	int found_step = 0;
-	MPI_Iprobe(0, STEP_TAG, this->comm, &found_step, MPI_STATUS_IGNORE);
-	return found_step;
-    }
-
-    void SynchronousFetchStep() {
-	MPI_Recv(&next_step,
-		 1,
-		 MPI_INT,
-		 MASTER_RANK,
-		 STEP_TAG,
-		 this->comm,
-		 MPI_STATUS_IGNORE);
-    }
+    // Ask the master for weights newer than cur_step. Returns the step
+    // of the snapshot now in snapshot_buffers.
+    int FetchSnapshot() {
+	int step = STEP_UNINITIALIZED;
+	MPI_Send(&cur_step, 1, MPI_INT, MASTER_RANK, SNAPSHOT_TAG, comm);
+	MPI_Recv(&step, 1, MPI_INT, MASTER_RANK, SNAPSHOT_TAG, comm, MPI_STATUS_IGNORE);
+	if (step >= run_config.n_train_iters) {
+	    return step;
+	}
 
-    void AsynchronousFetchStep() {
-	while (NewStepQueued()) {
-	    MPI_Irecv(&next_step,
-		      1,
-		      MPI_INT,
+	// Last layer has no weights.
+	for (int i = 0; i < layers.size()-1; i++) {
+	    MPI_Irecv(snapshot_buffers[i],
+		      layers[i]->GetLayerCount(),
+		      MPI_DOUBLE,
 		      MASTER_RANK,
-		      STEP_TAG,
-		      this->comm,
-		      &step_fetch_request);
-	}
-	MPI_Irecv(&next_step,
-		  1,
-		  MPI_INT,
-		  MASTER_RANK,
-		  STEP_TAG,
-		  this->comm,
-		  &step_fetch_request);
+		      step,
+		      layer_comms[i],
+		      &layer_fetch_requests[i]);
+	}
+	MPI_Waitall(layers.size()-1, layer_fetch_requests.data(), MPI_STATUSES_IGNORE);
+	return step;
     }
 
-    void AsynchronousFetchStepUpdate() {
-	int completed_step_fetch = 0;
-	if (step_fetch_request == MPI_REQUEST_NULL)
-	    completed_step_fetch = 1;
-	else
-	    MPI_Test(&step_fetch_request, &completed_step_fetch, MPI_STATUS_IGNORE);
-	if (completed_step_fetch) {
-	    AsynchronousFetchStep();
+    void ChooseEvaluationSet(uchar **data, uchar *labels, int n_examples) {
+	n_total_examples = n_examples;
+	std::vector<int> indices(n_examples);
+	for (int i = 0; i < n_examples; i++) {
+	    indices[i] = i;
+	}
+	int n_to_evaluate = n_examples;
+	if (EVALUATION_SUBSET_SIZE > 0 && EVALUATION_SUBSET_SIZE < n_examples) {
+	    std::mt19937 subset_generator(EVALUATION_SUBSET_SEED);
+	    std::shuffle(indices.begin(), indices.end(), subset_generator);
+	    n_to_evaluate = EVALUATION_SUBSET_SIZE;
+	}
+	for (int i = 0; i < n_to_evaluate; i++) {
+	    evaluation_data.push_back(data[indices[i]]);
+	    evaluation_labels.push_back(labels[indices[i]]);
 	}
     }
 
-    bool UpdateStep() {
-	bool changed = cur_step != next_step;
-	cur_step = next_step;
-	return changed;
+    void EvaluationLoop() {
+	while (true) {
+	    int step;
+	    double time;
+	    {
+		std::unique_lock<std::mutex> lock(evaluation_mutex);
+		evaluation_cv.wait(lock, [this] { return !evaluation_done; });
+		step = evaluation_step;
+		time = evaluation_time;
+	    }
+	    if (step >= run_config.n_train_iters) return;
+
+	    double evaluation_start = GetTimeMillis();
+	    Evaluate(step, time);
+
+	    {
+		std::lock_guard<std::mutex> lock(evaluation_mutex);
+		last_evaluation_millis = GetTimeMillis() - evaluation_start;
+		evaluation_done = true;
+	    }
+	    evaluation_cv.notify_all();
+	}
     }
 
-    // Fetch all layer weights asynchronously. (from master).
-    void AsynchronousFetchWeights() {
+    EvaluationTotals EvaluateSet(bool use_quantized) {
+	NNLayer *last = layers[layers.size()-1];
+	int n_examples = evaluation_data.size();
+	EvaluationTotals totals = {};
+	for (int start = 0; start < n_examples; start += batchsize) {
+	    int n_to_copy = std::min(batchsize, n_examples - start);
+	    MNISTOneHotLabelsToInput(n_to_copy, &evaluation_labels[start], batch_labels_placeholder);
+	    double *predictions;
+	    if (use_quantized) {
+		predictions = quantized->ForwardPropagate(&evaluation_data[start], n_to_copy);
+	    }
+	    else {
+		MNISTImageToInput(n_to_copy, &evaluation_data[start], batch_data_placeholder);
+		ForwardPropagate(batch_data_placeholder);
+		predictions = last->Output();
+	    }
+	    for (int example = 0; example < n_to_copy; example++) {
+		double example_loss = LogDot(&predictions[example*last->Dimension()],
+					     &batch_labels_placeholder[example*last->Dimension()],
+					     last->Dimension());
+		totals.loss += example_loss;
+		totals.loss_sq += example_loss * example_loss;
+		int prediction = Argmax(&predictions[example*last->Dimension()], last->Dimension());
+		if (prediction != evaluation_labels[start+example]) totals.n_wrong++;
+		totals.predictions.push_back(prediction);
+	    }
+	}
+	return totals;
+    }
 
-	// Last layer has no weights.
-	for (int i = 0; i < layers.size()-1; i++) {
-	    // Check if we have already fetched the weights for this
-	    // particular step. If so, don't fetch it.
-	    if (layer_cur_step[i] < cur_step) {
+    // Compare the quantized model against the double one on the same
+    // snapshot and say whether its numbers can be trusted.
+    void CheckQuantizedDrift(int step, EvaluationTotals &quantized_totals) {
+	EvaluationTotals exact = EvaluateSet(false);
+	int n_examples = evaluation_data.size(), n_disagree = 0;
+	for (int i = 0; i < n_examples; i++) {
+	    n_disagree += quantized_totals.predictions[i] != exact.predictions[i];
+	}
+	double error_drift = fabs(quantized_totals.n_wrong - exact.n_wrong) / n_examples;
+	double loss_drift = fabs(quantized_totals.loss - exact.loss) / std::max(exact.loss, BUMP);
+	bool drifted = error_drift > QUANTIZED_MAX_ERROR_DRIFT || loss_drift > QUANTIZED_MAX_LOSS_DRIFT;
+	std::cout << "Quantized drift at step " << step
+		  << ": loss " << quantized_totals.loss << " vs " << exact.loss
+		  << ", error " << quantized_totals.n_wrong / n_examples << " vs " << exact.n_wrong / n_examples
+		  << ", predictions differ on " << n_disagree << " of " << n_examples
+		  << (drifted ? " DRIFTED" : " ok") << std::endl;
+    }
 
-		// Be sure to free the layer fetch requests
-		if (layer_fetch_requests[i] != MPI_REQUEST_NULL) {
-		    MPI_Request_free(&layer_fetch_requests[i]);
-		}
+    // Loss and error rate in a single forward pass over the evaluation
+    // set. On a subset the loss is scaled up to the full set, and both
+    // get the half width of a 95% confidence interval appended.
+    void Evaluate(int step, double time) {
+	if (quantized) {
+	    quantized->Quantize(layers);
+	}
+	EvaluationTotals totals = EvaluateSet(quantized != NULL);
+	if (quantized && run_config.quantized_drift_check > 0 &&
+	    n_evaluations % run_config.quantized_drift_check == 0) {
+	    CheckQuantizedDrift(step, totals);
+	}
+	n_evaluations++;
 
-		MPI_Irecv(layers[i]->GetLayer(),
-			  layers[i]->GetLayerCount(),
-			  MPI_DOUBLE,
-			  MASTER_RANK,
-			  cur_step,
-			  layer_comms[i],
-			  &layer_fetch_requests[i]);
-	    }
+	int n_examples = evaluation_data.size();
+	double loss = totals.loss, loss_sq = totals.loss_sq;
+	double err_rate = totals.n_wrong / n_examples;
+	if (n_examples == n_total_examples) {
+	    time_loss_out << step << " " << time << " " << loss << " " << err_rate << std::endl;
+	    return;
 	}
+
+	double mean_loss = loss / n_examples;
+	double loss_var = std::max(0.0, loss_sq / n_examples - mean_loss * mean_loss);
+	double loss_ci = 1.96 * sqrt(loss_var / n_examples) * n_total_examples;
+	double err_ci = 1.96 * sqrt(err_rate * (1 - err_rate) / n_examples);
+	time_loss_out << step << " " << time << " " << mean_loss * n_total_examples << " " << err_rate
+		      << " " << loss_ci << " " << err_ci << std::endl;
     }
 };
 
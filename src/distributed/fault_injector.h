@@ -0,0 +1,87 @@
+#ifndef _FAULT_INJECTOR_
+#define _FAULT_INJECTOR_
+
+#include <cmath>
+#include <stdint.h>
+#include "distributed_defines.h"
+
+// Stragglers for local runs, where every worker runs at the same speed
+// and backup workers and short circuiting have nothing to tolerate.
+//
+// Each step a worker sleeps ComputeDelayMillis() before it computes, and
+// holds each layer's gradient offer back MessageDelayMillis() after the
+// gradient is ready, as a slow link would. Delays are drawn per step, in
+// ms, from run_config.compute_delay and message_delay:
+//
+//   fixed:MS            every worker, every step
+//   exponential:MEAN    memoryless, most steps short
+//   pareto:MIN:ALPHA    heavy tailed, at least MIN; ALPHA <= 2 for rare
+//                       very long delays
+//   slow_node:MS        only run_config.slow_ranks (by default the
+//                       highest rank)
+//
+// A delay depends only on fault_seed, rank, step and layer, so a run can
+// be repeated, and the master can tell which delay any worker was given
+// for the timeline without being told.
+class FaultInjector {
+ public:
+    FaultInjector(int n_procs) {
+	slow_ranks = run_config.slow_ranks;
+	if (slow_ranks.empty()) {
+	    slow_ranks.push_back(n_procs-1);
+	}
+    }
+
+    bool Enabled() {
+	return run_config.FaultsInjected();
+    }
+
+    double ComputeDelayMillis(int rank, int step) {
+	return Draw(run_config.compute_delay, rank, step, COMPUTE_STREAM);
+    }
+
+    double MessageDelayMillis(int rank, int step, int layer) {
+	return Draw(run_config.message_delay, rank, step, MESSAGE_STREAM + layer);
+    }
+
+ protected:
+    static const int COMPUTE_STREAM = 0;
+    static const int MESSAGE_STREAM = 1;
+
+    std::vector<int> slow_ranks;
+
+    double Draw(DelaySpec &spec, int rank, int step, int stream) {
+	if (spec.kind == "fixed") {
+	    return spec.a;
+	}
+	if (spec.kind == "slow_node") {
+	    return std::find(slow_ranks.begin(), slow_ranks.end(), rank) != slow_ranks.end() ? spec.a : 0;
+	}
+	double u = Uniform(rank, step, stream);
+	if (spec.kind == "exponential") {
+	    return -spec.a * log(1 - u);
+	}
+	if (spec.kind == "pareto") {
+	    return spec.a / pow(1 - u, 1 / spec.b);
+	}
+	return 0;
+    }
+
+    // In [0, 1), from SplitMix64 over the seed and key.
+    static double Uniform(int rank, int step, int stream) {
+	uint64_t x = Mix(run_config.fault_seed);
+	x = Mix(x ^ (uint32_t)rank);
+	x = Mix(x ^ (uint32_t)step);
+	x = Mix(x ^ (uint32_t)stream);
+	return (x >> 11) * (1.0 / (1ULL << 53));
+    }
+
+    static uint64_t Mix(uint64_t x) {
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+    }
+};
+
+#endif
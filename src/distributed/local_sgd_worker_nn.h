@@ -0,0 +1,152 @@
+#ifndef _LOCAL_SGD_WORKER_NN_
+#define _LOCAL_SGD_WORKER_NN_
+
+#include "distributed_defines.h"
+#include "worker_nn.h"
+
+// Local SGD worker. Each master step it takes local_steps ordinary SGD
+// steps on its own copy of the weights, then offers the model delta
+// (w_start - w_local) / learning_rate in place of a gradient. The master
+// averages those like gradients, which makes its update the average of
+// the workers' local models, so the wire protocol is unchanged while
+// communication per sample drops by local_steps.
+class LocalSGDWorkerNN : public WorkerNN {
+ public:
+    LocalSGDWorkerNN(NNParams *params, std::vector<MPI_Comm> &layer_comms, int rank, int n_procs,
+		     int local_steps, bool adaptive) : WorkerNN(params, layer_comms, rank, n_procs) {
+	this->local_steps = local_steps;
+	this->adaptive = adaptive;
+	this->local_step_millis = 0;
+
+	// Local steps update the weights, so shared ones must be copied.
+	this->zero_copy_weights = false;
+
+	for (int i = 0; i < layers.size()-1; i++) {
+	    double *start_weights;
+	    AllocateMemory(&start_weights, layers[i]->GetLayerCount());
+	    round_start_weights.push_back(start_weights);
+	}
+    }
+
+    ~LocalSGDWorkerNN() {
+	for (int i = 0; i < round_start_weights.size(); i++) {
+	    free(round_start_weights[i]);
+	}
+    }
+
+    void Train(uchar **data, uchar *labels, int n_examples) override {
+
+	SynchronousFetchStep();
+	assert(UpdateStep());
+	assert(cur_step == STEP_START);
+
+	std::cout << "Local SGD worker " << rank << " starting training..." << std::endl;
+	bool first = true;
+
+	while (true) {
+
+	    AsynchronousFetchStepUpdate();
+	    ProgressGradientSends();
+	    bool updated = UpdateStep();
+	    if (!updated && !first) {
+		Idle(data, labels, n_examples);
+		continue;
+	    }
+	    EndIdle();
+	    if (adaptive && !first) {
+		AdaptLocalSteps(false);
+	    }
+	    first = false;
+	    n_steps_trained++;
+	    AsynchronousFetchWeights();
+
+	    if (cur_step >= run_config.n_train_iters) break;
+
+	    // The previous round's deltas live in the gradient buffers, so
+	    // they have to be out before the local steps overwrite them.
+	    weights_step = cur_step;
+	    for (int i = 0; i < layers.size()-1; i++) {
+		ResolveGradientSend(i);
+		if (layer_send_requests[i] != MPI_REQUEST_NULL) {
+		    MPI_Wait(&layer_send_requests[i], MPI_STATUS_IGNORE);
+		}
+		WaitLayerWeights(i);
+		memcpy(round_start_weights[i], layers[i]->GetLayer(), sizeof(double) * layers[i]->GetLayerCount());
+	    }
+
+	    // An injected delay counts as part of the round, so adaptive
+	    // local steps see a straggler as one.
+	    double round_start = GetTimeMillis();
+	    bool short_circuited = InjectComputeDelay();
+	    for (int k = 0; k < local_steps && !short_circuited; k++) {
+		if (run_config.shortcircuit && StepChanged()) {
+		    std::cout << "SHORTCIRCUIT" << std::endl;
+		    short_circuited = true;
+		    break;
+		}
+		if (!batch_prefetched) {
+		    FillNextBatch(data, labels, n_examples);
+		}
+		batch_prefetched = false;
+
+		// BackPropagate applies each layer's gradient locally.
+		ForwardPropagate(batch_data_placeholder);
+		BackPropagate(batch_labels_placeholder);
+	    }
+
+	    // Our local model missed the step, the next step's weights
+	    // replace it.
+	    if (short_circuited) {
+		if (adaptive) {
+		    AdaptLocalSteps(true);
+		}
+		continue;
+	    }
+	    local_step_millis = (GetTimeMillis() - round_start) / local_steps;
+	    CountWeightSteps();
+
+	    for (int i = 0; i < layers.size()-1; i++) {
+		MatrixAdd(round_start_weights[i], layers[i]->GetLayer(), layers[i]->GetGradient(),
+			  1 / learning_rate, -1 / learning_rate,
+			  layers[i]->NRows(), layers[i]->NCols(),
+			  layers[i]->NCols(), layers[i]->NCols(), layers[i]->NCols());
+		AsynchronousSendGradientHeader(i);
+	    }
+	    ProgressGradientSends();
+	}
+
+	DrainWeightFetches();
+	FinishAggregation();
+	AbandonGradientSends();
+	CancelStepFetch();
+	std::cout << "Worker " << rank << " gradient bytes sent: " << bytes_sent
+		  << " suppressed: " << bytes_suppressed
+		  << " shared: " << bytes_shared
+		  << " to node leader: " << bytes_to_leader
+		  << " local steps: " << local_steps << std::endl;
+	if (aggregator) {
+	    aggregator->Print(rank);
+	}
+	PrintInjectedDelays();
+	PrintStepStats();
+    }
+
+ protected:
+    int local_steps;
+    bool adaptive;
+    double local_step_millis;
+    std::vector<double *> round_start_weights;
+
+    // Additive increase while we idle for longer than a local step takes,
+    // multiplicative decrease when we are the ones holding up the step.
+    void AdaptLocalSteps(bool short_circuited) {
+	if (short_circuited) {
+	    local_steps = std::max(1, local_steps / 2);
+	}
+	else if (last_idle_millis > local_step_millis) {
+	    local_steps = std::min(LOCAL_SGD_MAX_STEPS, local_steps + 1);
+	}
+    }
+};
+
+#endif
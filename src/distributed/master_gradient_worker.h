@@ -0,0 +1,109 @@
+#ifndef _MASTER_GRADIENT_WORKER_
+#define _MASTER_GRADIENT_WORKER_
+
+#include "distributed_defines.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Lets the master contribute gradients, computed on its own shard on a
+// thread of its own while the main thread receives and sums the
+// workers'. It has its own copy of the network, so the master's weights
+// and gradient sums are never touched from here, and makes no MPI calls.
+class MasterGradientWorker : public NN {
+ public:
+    MasterGradientWorker(NNParams *params, uchar **data, uchar *labels, int n_examples) : NN(params) {
+	this->data = data;
+	this->labels = labels;
+	this->n_examples = n_examples;
+	job_step = ready_step = STEP_UNINITIALIZED;
+	busy = stopping = false;
+	n_computed = 0;
+	compute_thread = std::thread(&MasterGradientWorker::ComputeLoop, this);
+    }
+
+    ~MasterGradientWorker() {
+	{
+	    std::lock_guard<std::mutex> lock(mutex);
+	    stopping = true;
+	}
+	cv.notify_all();
+	compute_thread.join();
+    }
+
+    // Start a gradient for `step` on a copy of `weights`, unless the
+    // previous one is still being computed. An unused finished gradient
+    // is dropped.
+    bool Start(int step, std::vector<NNLayer *> &weights) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (busy) return false;
+	for (int i = 0; i < layers.size()-1; i++) {
+	    memcpy(layers[i]->GetLayer(), weights[i]->GetLayer(), sizeof(double) * layers[i]->GetLayerCount());
+	}
+	job_step = step;
+	ready_step = STEP_UNINITIALIZED;
+	busy = true;
+	cv.notify_all();
+	return true;
+    }
+
+    bool Busy() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return busy;
+    }
+
+    // The step of a finished gradient not yet released, or
+    // STEP_UNINITIALIZED.
+    int Ready() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return ready_step;
+    }
+
+    double *Gradient(int l) {
+	return layers[l]->GetGradient();
+    }
+
+    void Release() {
+	std::lock_guard<std::mutex> lock(mutex);
+	ready_step = STEP_UNINITIALIZED;
+    }
+
+    int NComputed() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return n_computed;
+    }
+
+ protected:
+    uchar **data, *labels;
+    int n_examples;
+
+    // Guarded by mutex.
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool busy, stopping;
+    int job_step, ready_step, n_computed;
+    std::thread compute_thread;
+
+    void ComputeLoop() {
+	while (true) {
+	    {
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [this] { return busy || stopping; });
+		if (stopping) return;
+	    }
+
+	    for (int m = 0; m < n_micro_batches; m++) {
+		FillNextBatch(data, labels, n_examples);
+		ForwardPropagate(batch_data_placeholder);
+		ComputeGradients(batch_labels_placeholder, m > 0);
+	    }
+
+	    std::lock_guard<std::mutex> lock(mutex);
+	    ready_step = job_step;
+	    busy = false;
+	    n_computed++;
+	}
+    }
+};
+
+#endif
@@ -0,0 +1,239 @@
+#ifndef _NODE_AGGREGATOR_
+#define _NODE_AGGREGATOR_
+
+#include <chrono>
+#include "distributed_defines.h"
+#include "shared_memory_transport.h"
+
+// First level of two level gradient aggregation.
+//
+// The workers of a node, other than those already sharing memory with
+// the master, form a group whose lowest rank is the leader. Members
+// send their gradients to the leader, within the node, instead of
+// offering them to the master. The leader sums the gradients it receives
+// and its own by layer and step, and offers each sum to the master with
+// a count of the gradients in it. The master therefore receives one
+// gradient per node and step rather than one per worker.
+//
+// A sum is offered once every member of the group has added to it, or
+// HIERARCHICAL_FLUSH_US after its first gradient, so that with backup
+// workers a slow member does not hold up the rest of its node. Its
+// gradient goes out in a later sum, for the same step. A sum still open
+// when a gradient for a newer step arrives is dropped: its step is
+// over.
+//
+// Since a sum holds one step, this only suits the synchronous master:
+// with STALENESS > 0 the workers of a node are on different steps, all
+// of which the master would take. distributed_nn refuses the two
+// together, as it does RMA_PARAMETER_SERVER.
+//
+// Collective over comm. Only the main thread calls in.
+class NodeAggregator {
+ public:
+    NodeAggregator(MPI_Comm comm, std::vector<size_t> layer_counts, SharedMemoryTransport *transport) {
+	this->layer_counts = layer_counts;
+	group_rank = 0;
+	group_size = 1;
+	n_added = n_dropped = n_offers = n_contributed = 0;
+	n_finished = 0;
+
+	int rank;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm node_comm;
+	MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node_comm);
+	int node = rank;
+	MPI_Bcast(&node, 1, MPI_INT, 0, node_comm);
+	MPI_Comm_free(&node_comm);
+
+	bool member = rank != MASTER_RANK && rank != EVALUATOR_RANK && !(transport && transport->IsLocal(rank));
+	MPI_Comm group;
+	MPI_Comm_split(comm, member ? node : MPI_UNDEFINED, rank, &group);
+	if (group == MPI_COMM_NULL) {
+	    return;
+	}
+	MPI_Comm_rank(group, &group_rank);
+	MPI_Comm_size(group, &group_size);
+	for (int l = 0; l < layer_counts.size(); l++) {
+	    group_comms.push_back(MPI_COMM_NULL);
+	    MPI_Comm_dup(group, &group_comms[l]);
+	}
+	MPI_Comm_free(&group);
+
+	if (!Enabled() || !IsLeader()) {
+	    return;
+	}
+
+	// A member has at most one gradient per layer in flight, so one
+	// receive slot per member and layer never leaves a send waiting.
+	int n_members = group_size-1;
+	slot_buffers.resize(layer_counts.size() * n_members);
+	slot_requests.resize(layer_counts.size() * n_members, MPI_REQUEST_NULL);
+	completed_slots.resize(slot_requests.size());
+	completed_statuses.resize(slot_requests.size());
+	for (int l = 0; l < layer_counts.size(); l++) {
+	    sums.push_back(NULL);
+	    sending.push_back(NULL);
+	    AllocateMemory(&sums[l], layer_counts[l]);
+	    AllocateMemory(&sending[l], layer_counts[l]);
+	    sum_step.push_back(STEP_UNINITIALIZED);
+	    sum_count.push_back(0);
+	    sum_start.push_back(std::chrono::steady_clock::now());
+	    for (int k = 0; k < n_members; k++) {
+		AllocateMemory(&slot_buffers[l*n_members+k], layer_counts[l]);
+		PostReceive(l*n_members+k);
+	    }
+	}
+    }
+
+    ~NodeAggregator() {
+	for (int i = 0; i < slot_buffers.size(); i++) {
+	    free(slot_buffers[i]);
+	}
+	for (int l = 0; l < sums.size(); l++) {
+	    free(sums[l]);
+	    free(sending[l]);
+	}
+	for (int l = 0; l < group_comms.size(); l++) {
+	    MPI_Comm_free(&group_comms[l]);
+	}
+    }
+
+    // Whether this rank is in a group with anyone to aggregate with.
+    bool Enabled() {
+	return group_size > 1;
+    }
+
+    bool IsLeader() {
+	return group_rank == LEADER;
+    }
+
+    // Member: send layer l's gradient for step to the leader. request
+    // completes once the gradient may be overwritten.
+    void Contribute(int l, int step, double *gradient, MPI_Request *request) {
+	n_contributed++;
+	MPI_Isend(gradient, layer_counts[l], MPI_DOUBLE, LEADER, step, group_comms[l], request);
+    }
+
+    // Leader: add a gradient of layer l for step to the layer's sum.
+    void Add(int l, int step, double *gradient) {
+	if (step < sum_step[l]) {
+	    n_dropped++;
+	    return;
+	}
+	if (step > sum_step[l]) {
+	    n_dropped += sum_count[l];
+	    sum_step[l] = step;
+	    sum_count[l] = 0;
+	}
+	double *sum = sums[l];
+	if (sum_count[l] == 0) {
+	    memcpy(sum, gradient, sizeof(double) * layer_counts[l]);
+	    sum_start[l] = std::chrono::steady_clock::now();
+	}
+	else {
+	    task_pool.ParallelFor(0, layer_counts[l], TASK_POOL_GRAIN, [&](long first, long last) {
+		for (long i = first; i < last; i++) {
+		    sum[i] += gradient[i];
+		}
+	    });
+	}
+	sum_count[l]++;
+	n_added++;
+    }
+
+    // Leader: add the members' gradients that have arrived.
+    void Progress() {
+	if (slot_requests.empty()) return;
+	int n_completed = 0;
+	MPI_Testsome(slot_requests.size(), slot_requests.data(), &n_completed,
+		     completed_slots.data(), completed_statuses.data());
+	for (int i = 0; i < n_completed; i++) {
+	    Received(completed_slots[i], completed_statuses[i]);
+	}
+    }
+
+    // Leader: hand over layer l's sum to be offered to the master, if it
+    // is due. The previous one handed over must have been sent.
+    bool Flush(int l, int *step, int *count, double **gradient) {
+	if (sum_count[l] == 0) return false;
+	if (sum_count[l] < group_size &&
+	    std::chrono::steady_clock::now() - sum_start[l] < std::chrono::microseconds(HIERARCHICAL_FLUSH_US)) {
+	    return false;
+	}
+	std::swap(sums[l], sending[l]);
+	*step = sum_step[l];
+	*count = sum_count[l];
+	*gradient = sending[l];
+	sum_count[l] = 0;
+	n_offers++;
+	return true;
+    }
+
+    // Members say they are done once their last gradient is on its way;
+    // the leader takes everything sent to it before that, so no send is
+    // left unmatched.
+    void Finish() {
+	if (!IsLeader()) {
+	    for (int l = 0; l < group_comms.size(); l++) {
+		MPI_Send(NULL, 0, MPI_DOUBLE, LEADER, DONE_TAG, group_comms[l]);
+	    }
+	    return;
+	}
+	while (n_finished < slot_requests.size()) {
+	    int index;
+	    MPI_Status status;
+	    MPI_Waitany(slot_requests.size(), slot_requests.data(), &index, &status);
+	    Received(index, status);
+	}
+    }
+
+    void Print(int rank) {
+	if (IsLeader()) {
+	    std::cout << "Node leader " << rank << " summed " << n_added << " gradients of " << group_size
+		      << " workers into " << n_offers << " offers, dropped " << n_dropped << std::endl;
+	}
+	else {
+	    std::cout << "Worker " << rank << " sent " << n_contributed << " gradients to its node leader" << std::endl;
+	}
+    }
+
+ protected:
+    static const int LEADER = 0;
+
+    // Gradients are tagged with their step, which starts at STEP_START.
+    static const int DONE_TAG = 0;
+
+    std::vector<size_t> layer_counts;
+    std::vector<MPI_Comm> group_comms;
+    int group_rank, group_size;
+
+    // Leader only. Slot l*(group_size-1)+k is the k-th receive of layer
+    // l. sums[l] collects sum_count[l] gradients for sum_step[l], since
+    // sum_start[l]; sending[l] holds the last sum handed over.
+    std::vector<double *> slot_buffers;
+    std::vector<MPI_Request> slot_requests;
+    std::vector<int> completed_slots;
+    std::vector<MPI_Status> completed_statuses;
+    std::vector<double *> sums, sending;
+    std::vector<int> sum_step, sum_count;
+    std::vector<std::chrono::steady_clock::time_point> sum_start;
+    int n_finished;
+    long long int n_added, n_dropped, n_offers, n_contributed;
+
+    void PostReceive(int slot) {
+	int l = slot / (group_size-1);
+	MPI_Irecv(slot_buffers[slot], layer_counts[l], MPI_DOUBLE, MPI_ANY_SOURCE, MPI_ANY_TAG,
+		  group_comms[l], &slot_requests[slot]);
+    }
+
+    void Received(int slot, MPI_Status &status) {
+	if (status.MPI_TAG == DONE_TAG) {
+	    n_finished++;
+	    return;
+	}
+	Add(slot / (group_size-1), status.MPI_TAG, slot_buffers[slot]);
+	PostReceive(slot);
+    }
+};
+
+#endif
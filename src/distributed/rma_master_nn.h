@@ -0,0 +1,92 @@
+#ifndef _RMA_MASTER_NN_
+#define _RMA_MASTER_NN_
+
+#include "distributed_defines.h"
+#include "sync_replicas_master_nn.h"
+#include "rma_parameter_store.h"
+
+// Parameter server on one-sided communication. Workers read weights from
+// and sum gradients into the master's windows themselves (see
+// rma_parameter_store.h), so no receives are posted or matched per
+// gradient. Each step the master publishes the weights, waits for the
+// window to hold n_to_collect gradients and applies their average.
+// Workers past the first n_to_collect drop their gradient, as backup
+// workers do under SyncReplicasMasterNN.
+// The evaluator is still served over point to point messages.
+class RMAMasterNN : public SyncReplicasMasterNN {
+ public:
+    RMAMasterNN(NNParams *params, std::vector<MPI_Comm> &layer_comms, int n_procs, int n_to_collect,
+		int staleness, RMAParameterStore *store) :
+	SyncReplicasMasterNN(params, layer_comms, n_procs, n_to_collect,
+			     "RMAStaleness" + std::to_string(staleness) + "_") {
+	this->store = store;
+	for (int i = 0; i < layers.size()-1; i++) {
+	    layer_weights.push_back(layers[i]->GetLayer());
+	    layer_gradients.push_back(layers[i]->GetGradient());
+	}
+    }
+
+    void Train(uchar **data, uchar *labels, int examples) override {
+
+	// Only the evaluator's snapshot request is used, no gradient
+	// header ever arrives.
+	AsynchronousFetchGradientsStart();
+
+	start_training_time = GetTimeMillis();
+
+	while (cur_step < run_config.n_train_iters) {
+	    store->PublishWeights(cur_step, layer_weights);
+	    store->OpenStep(cur_step, n_to_collect);
+	    MaybeSendEvaluatorSnapshot();
+
+	    if (run_config.generate_timeline) {
+		LogReceptionEvent(cur_step, 1);
+	    }
+
+	    while (store->Count() < n_to_collect) {
+		ProgressEvaluatorSnapshots();
+	    }
+
+	    // Closing the step turns away gradients still on their way.
+	    int count = store->Collect(layer_gradients);
+	    bytes_received += sizeof(double) * count * GradientCount();
+	    std::cout << "Gradients accumulated: " << count << std::endl;
+	    gradients_applied += count;
+	    for (int layer = 0; layer < layers.size()-1; layer++) {
+		layers[layer]->ApplyGrad(learning_rate / count, layers[layer]->GetGradient());
+	    }
+
+	    cur_step++;
+	}
+	store->OpenStep(cur_step, 0);
+
+	AsynchronousFetchGradientHeadersCancel();
+	FinishEvaluatorSnapshots();
+	WaitWeightSends();
+	PrintCommunicationStats();
+	PrintThroughput();
+    }
+
+ protected:
+    RMAParameterStore *store;
+    std::vector<double *> layer_weights, layer_gradients;
+
+    size_t GradientCount() {
+	size_t count = 0;
+	for (int i = 0; i < layers.size()-1; i++) {
+	    count += layers[i]->GetLayerCount();
+	}
+	return count;
+    }
+
+    void ProgressEvaluatorSnapshots() {
+	int completed = 0;
+	MPI_Test(SnapshotRequest(), &completed, MPI_STATUS_IGNORE);
+	if (completed) {
+	    evaluator_snapshot_pending = true;
+	    MaybeSendEvaluatorSnapshot();
+	}
+    }
+};
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef _RMA_PARAMETER_STORE_
+#define _RMA_PARAMETER_STORE_
+
+#include "distributed_defines.h"
+
+// One-sided parameter server state, exposed by the master through two
+// MPI RMA windows.
+//
+// The weights window holds the step of the published weights followed
+// by all layer weights. The accumulator window holds the step gradients
+// are accepted for, the number of gradients summed so far, the number
+// claimed and wanted, and the sum. A worker claims a place with
+// MPI_Fetch_and_op before sending its gradient, so surplus gradients
+// cost a word rather than a model, as with the gradient headers of the
+// two-sided protocol. Workers Get the weights and Accumulate their
+// gradients under a shared lock; the master publishes and collects under
+// an exclusive lock on itself, so both see whole updates and a gradient
+// either makes it into a step's sum or is turned away, never half of it.
+class RMAParameterStore {
+ public:
+    RMAParameterStore(MPI_Comm comm, std::vector<size_t> layer_counts) {
+	this->layer_counts = layer_counts;
+	MPI_Comm_rank(comm, &rank);
+
+	offsets.push_back(0);
+	for (int i = 0; i < layer_counts.size(); i++) {
+	    offsets.push_back(offsets.back() + layer_counts[i]);
+	}
+	size_t model_count = offsets.back();
+
+	size_t weights_count = 0, accumulator_count = 0;
+	if (rank == MASTER_RANK) {
+	    weights_count = WEIGHTS_HEADER + model_count;
+	    accumulator_count = ACCUMULATOR_HEADER + model_count;
+	}
+	MPI_Win_allocate(sizeof(double) * weights_count, sizeof(double), MPI_INFO_NULL,
+			 comm, &weights, &weights_win);
+	MPI_Win_allocate(sizeof(double) * accumulator_count, sizeof(double), MPI_INFO_NULL,
+			 comm, &accumulator, &accumulator_win);
+
+	if (rank == MASTER_RANK) {
+	    MPI_Win_lock(MPI_LOCK_EXCLUSIVE, MASTER_RANK, 0, weights_win);
+	    memset(weights, 0, sizeof(double) * weights_count);
+	    weights[0] = STEP_UNINITIALIZED;
+	    MPI_Win_unlock(MASTER_RANK, weights_win);
+	    MPI_Win_lock(MPI_LOCK_EXCLUSIVE, MASTER_RANK, 0, accumulator_win);
+	    memset(accumulator, 0, sizeof(double) * accumulator_count);
+	    accumulator[0] = STEP_UNINITIALIZED;
+	    MPI_Win_unlock(MASTER_RANK, accumulator_win);
+	}
+	MPI_Barrier(comm);
+    }
+
+    // Collective, like the constructor.
+    ~RMAParameterStore() {
+	MPI_Win_free(&weights_win);
+	MPI_Win_free(&accumulator_win);
+    }
+
+    // Master: make `layer_weights` the weights of `step`.
+    void PublishWeights(int step, std::vector<double *> &layer_weights) {
+	MPI_Win_lock(MPI_LOCK_EXCLUSIVE, MASTER_RANK, 0, weights_win);
+	for (int i = 0; i < layer_counts.size(); i++) {
+	    memcpy(&weights[WEIGHTS_HEADER + offsets[i]], layer_weights[i], sizeof(double) * layer_counts[i]);
+	}
+	weights[0] = step;
+	MPI_Win_unlock(MASTER_RANK, weights_win);
+    }
+
+    // Master: start accepting `wanted` gradients for `step`.
+    void OpenStep(int step, int wanted) {
+	MPI_Win_lock(MPI_LOCK_EXCLUSIVE, MASTER_RANK, 0, accumulator_win);
+	accumulator[0] = step;
+	accumulator[1] = accumulator[2] = 0;
+	accumulator[3] = wanted;
+	MPI_Win_unlock(MASTER_RANK, accumulator_win);
+    }
+
+    // Master: number of gradients summed for the open step. Locking
+    // also lets the MPI library progress the workers' operations.
+    int Count() {
+	double count;
+	MPI_Win_lock(MPI_LOCK_SHARED, MASTER_RANK, 0, accumulator_win);
+	ReadHeader(&count, 1, 1);
+	MPI_Win_unlock(MASTER_RANK, accumulator_win);
+	return count;
+    }
+
+    // Master: close the open step, move the summed gradients into `sums`
+    // and clear the sum. Returns the number of gradients summed. The next
+    // step is opened once its weights are published, so workers never
+    // wait on the exclusive lock taken to publish them.
+    int Collect(std::vector<double *> &sums) {
+	MPI_Win_lock(MPI_LOCK_EXCLUSIVE, MASTER_RANK, 0, accumulator_win);
+	int count = accumulator[1];
+	for (int i = 0; i < layer_counts.size(); i++) {
+	    memcpy(sums[i], &accumulator[ACCUMULATOR_HEADER + offsets[i]], sizeof(double) * layer_counts[i]);
+	}
+	memset(&accumulator[ACCUMULATOR_HEADER], 0, sizeof(double) * offsets.back());
+	accumulator[1] = accumulator[2] = accumulator[3] = 0;
+	MPI_Win_unlock(MASTER_RANK, accumulator_win);
+	return count;
+    }
+
+    // Worker: the step gradients are currently accepted for.
+    int OpenedStep() {
+	double step;
+	MPI_Win_lock(MPI_LOCK_SHARED, MASTER_RANK, 0, accumulator_win);
+	ReadHeader(&step, 0, 1);
+	MPI_Win_unlock(MASTER_RANK, accumulator_win);
+	return step;
+    }
+
+    // Worker: whether a gradient computed on the weights of `step` would
+    // still be taken.
+    bool GradientWanted(int step, int staleness) {
+	double header[ACCUMULATOR_HEADER];
+	MPI_Win_lock(MPI_LOCK_SHARED, MASTER_RANK, 0, accumulator_win);
+	ReadHeader(header, 0, ACCUMULATOR_HEADER);
+	MPI_Win_unlock(MASTER_RANK, accumulator_win);
+	return header[0] - step <= staleness && header[2] < header[3];
+    }
+
+    // Worker: read the published weights. Returns their step.
+    int FetchWeights(std::vector<double *> &layer_weights) {
+	double step;
+	MPI_Win_lock(MPI_LOCK_SHARED, MASTER_RANK, 0, weights_win);
+	MPI_Get(&step, 1, MPI_DOUBLE, MASTER_RANK, 0, 1, MPI_DOUBLE, weights_win);
+	for (int i = 0; i < layer_counts.size(); i++) {
+	    MPI_Get(layer_weights[i], layer_counts[i], MPI_DOUBLE,
+		    MASTER_RANK, WEIGHTS_HEADER + offsets[i], layer_counts[i], MPI_DOUBLE, weights_win);
+	}
+	MPI_Win_unlock(MASTER_RANK, weights_win);
+	return step;
+    }
+
+    // Worker: add gradients computed on the weights of `step` to the sum,
+    // unless the open step is more than `staleness` past it or has all
+    // the gradients it wants. Returns whether they were added.
+    bool AccumulateGradients(int step, int staleness, std::vector<double *> &gradients) {
+	double header[ACCUMULATOR_HEADER], claimed, one = 1;
+	MPI_Win_lock(MPI_LOCK_SHARED, MASTER_RANK, 0, accumulator_win);
+	ReadHeader(header, 0, ACCUMULATOR_HEADER);
+
+	// The open step can't change while we hold the lock, but a stale
+	// gradient must not take a place from a fresh one.
+	if (header[0] - step > staleness) {
+	    MPI_Win_unlock(MASTER_RANK, accumulator_win);
+	    return false;
+	}
+	MPI_Fetch_and_op(&one, &claimed, MPI_DOUBLE, MASTER_RANK, 2, MPI_SUM, accumulator_win);
+	MPI_Win_flush(MASTER_RANK, accumulator_win);
+	bool accepted = claimed < header[3];
+	if (accepted) {
+	    for (int i = 0; i < layer_counts.size(); i++) {
+		MPI_Accumulate(gradients[i], layer_counts[i], MPI_DOUBLE,
+			       MASTER_RANK, ACCUMULATOR_HEADER + offsets[i], layer_counts[i], MPI_DOUBLE,
+			       MPI_SUM, accumulator_win);
+	    }
+	    MPI_Accumulate(&one, 1, MPI_DOUBLE, MASTER_RANK, 1, 1, MPI_DOUBLE, MPI_SUM, accumulator_win);
+	}
+	MPI_Win_unlock(MASTER_RANK, accumulator_win);
+	return accepted;
+    }
+
+ protected:
+    static const int WEIGHTS_HEADER = 1;
+    static const int ACCUMULATOR_HEADER = 4;
+
+    // Read accumulator header words while other ranks may be adding to
+    // them. Mixing a plain Get with their Accumulates is undefined, so
+    // this is an atomic no-op accumulate. Needs the lock held; returns
+    // once the words have arrived.
+    void ReadHeader(double *header, int first, int count) {
+	MPI_Get_accumulate(NULL, 0, MPI_DOUBLE, header, count, MPI_DOUBLE,
+			   MASTER_RANK, first, count, MPI_DOUBLE, MPI_NO_OP, accumulator_win);
+	MPI_Win_flush(MASTER_RANK, accumulator_win);
+    }
+
+    int rank;
+    double *weights, *accumulator;
+    MPI_Win weights_win, accumulator_win;
+    std::vector<size_t> layer_counts, offsets;
+};
+
+#endif
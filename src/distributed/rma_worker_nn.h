@@ -0,0 +1,131 @@
+#ifndef _RMA_WORKER_NN_
+#define _RMA_WORKER_NN_
+
+#include "distributed_defines.h"
+#include "worker_nn.h"
+#include "rma_parameter_store.h"
+
+// Worker for RMAMasterNN. Steps are discovered by reading the open step
+// from the master's window, weights are fetched with MPI_Get and
+// gradients summed into the master's accumulator with MPI_Accumulate.
+// The master takes no part in any of it.
+class RMAWorkerNN : public WorkerNN {
+ public:
+    RMAWorkerNN(NNParams *params, std::vector<MPI_Comm> &layer_comms, int rank, int n_procs,
+		int staleness, RMAParameterStore *store) : WorkerNN(params, layer_comms, rank, n_procs, staleness) {
+	this->store = store;
+	this->turned_away_step = STEP_UNINITIALIZED;
+	for (int i = 0; i < layers.size()-1; i++) {
+	    layer_weights.push_back(layers[i]->GetLayer());
+	    layer_gradients.push_back(layers[i]->GetGradient());
+	}
+    }
+
+    void Train(uchar **data, uchar *labels, int n_examples) override {
+
+	std::cout << "RMA worker " << rank << " starting training..." << std::endl;
+
+	while (true) {
+	    int opened = store->OpenedStep();
+	    if (opened >= run_config.n_train_iters) break;
+
+	    // Without staleness every step gets fresh weights, otherwise
+	    // ours do until they fall too far behind.
+	    bool stale = cur_step == STEP_UNINITIALIZED || opened - cur_step > staleness;
+	    if (opened != cur_step && (staleness == 0 || stale)) {
+		if (store->FetchWeights(layer_weights) != opened) {
+		    // Published but not yet opened.
+		    continue;
+		}
+		cur_step = opened;
+	    }
+	    else if (staleness == 0 || opened == turned_away_step) {
+		// With no step or gradient requests pending, IDLE_BLOCK
+		// degrades to spinning here.
+		Idle(data, labels, n_examples);
+		continue;
+	    }
+	    EndIdle();
+	    n_steps_trained++;
+
+	    // An injected compute delay is cut short like the computation.
+	    double delay = faults.ComputeDelayMillis(rank, cur_step), delay_start = GetTimeMillis();
+	    bool short_circuited = false;
+	    while (GetTimeMillis() - delay_start < delay && !short_circuited) {
+		usleep(1000);
+		short_circuited = run_config.shortcircuit && !store->GradientWanted(cur_step, staleness);
+	    }
+	    injected_compute_millis += GetTimeMillis() - delay_start;
+	    if (short_circuited) {
+		std::cout << "SHORTCIRCUIT" << std::endl;
+	    }
+
+	    for (int m = 0; m < n_micro_batches && !short_circuited; m++) {
+		if (m > 0 || !batch_prefetched) {
+		    FillNextBatch(data, labels, n_examples);
+		}
+		batch_prefetched = false;
+
+		for (int i = 0; i < layers.size(); i++) {
+		    if (run_config.shortcircuit && !store->GradientWanted(cur_step, staleness)) {
+			std::cout << "SHORTCIRCUIT" << std::endl;
+			short_circuited = true;
+			break;
+		    }
+		    layers[i]->ForwardPropagateCore(batch_data_placeholder);
+		}
+		if (!short_circuited) {
+		    ComputeGradients(batch_labels_placeholder, m > 0);
+		}
+	    }
+	    if (short_circuited) {
+		turned_away_step = opened;
+		continue;
+	    }
+
+	    // Every layer goes in one accumulate, held back by the slowest
+	    // layer's message delay.
+	    double message_delay = 0;
+	    for (int i = 0; i < layers.size()-1; i++) {
+		message_delay = std::max(message_delay, faults.MessageDelayMillis(rank, cur_step, i));
+	    }
+	    if (message_delay > 0) {
+		usleep(message_delay * 1000);
+		injected_message_millis += message_delay;
+	    }
+
+	    if (store->AccumulateGradients(cur_step, staleness, layer_gradients)) {
+		bytes_sent += sizeof(double) * GradientCount();
+	    }
+	    else {
+		bytes_suppressed += sizeof(double) * GradientCount();
+		turned_away_step = opened;
+	    }
+	}
+
+	std::cout << "Worker " << rank << " gradient bytes sent: " << bytes_sent
+		  << " suppressed: " << bytes_suppressed << std::endl;
+	PrintInjectedDelays();
+	std::cout << "Worker " << rank << " idle: " << idle_wall_millis << " ms wall, "
+		  << idle_cpu_millis << " ms cpu, "
+		  << idle_cpu_millis / std::max(n_steps_trained, 1) << " core-ms wasted per step" << std::endl;
+    }
+
+ protected:
+    RMAParameterStore *store;
+
+    // The open step that last turned our gradient away. Until the
+    // next one opens, computing another is wasted.
+    int turned_away_step;
+    std::vector<double *> layer_weights, layer_gradients;
+
+    size_t GradientCount() {
+	size_t count = 0;
+	for (int i = 0; i < layers.size()-1; i++) {
+	    count += layers[i]->GetLayerCount();
+	}
+	return count;
+    }
+};
+
+#endif
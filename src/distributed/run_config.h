@@ -0,0 +1,328 @@
+#ifndef _RUN_CONFIG_
+#define _RUN_CONFIG_
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+// A conv_layers entry: "channels:kernel" convolves, "pN" max pools N x N
+// before the next layer, convolution or fully connected.
+struct ConvSpec {
+    int channels, kernel, pool;
+};
+
+// A compute_delay or message_delay in ms: "none", "fixed:MS",
+// "exponential:MEAN", "pareto:MIN:ALPHA" or "slow_node:MS" (see
+// fault_injector.h).
+struct DelaySpec {
+    string kind;
+    double a, b;
+
+    string Name() {
+	std::stringstream name;
+	name << kind;
+	if (kind != "none") name << ":" << a;
+	if (kind == "pareto") name << ":" << b;
+	return name.str();
+    }
+};
+
+// Settings that can change between runs without a recompile. Defaults
+// come from the #defines in distributed_defines.h, then a config file of
+// "key = value" lines ('#' starts a comment) and the command line
+// override them, in the order given:
+//
+//   distributed_nn --config sweep.cfg --batch_size=256 --n_backup_workers 2
+//
+// Every rank parses the same arguments, so they all agree.
+class RunConfig {
+ public:
+    int n_train_iters;
+    bool shortcircuit;
+    bool generate_timeline;
+    int batch_size;
+
+    // Batches of batch_size whose gradients are summed into one step.
+    int micro_batches;
+    double learning_rate;
+
+    // Hidden layer widths; the input and output layers follow the data.
+    std::vector<int> hidden_layers;
+
+    // Convolutions between the input and the hidden layers, e.g.
+    // "8:5,p2,16:5,p2". None by default.
+    std::vector<ConvSpec> conv_layers;
+
+    // Gradients the master waits for each step. 0 means every worker but
+    // n_backup_workers.
+    int n_to_collect;
+    int n_backup_workers;
+
+    // The master also computes gradients, counting as one more worker.
+    bool master_computes;
+
+    // Evaluate with int8 weights, checking them against double every
+    // quantized_drift_check evaluations (0 never).
+    bool quantized_evaluation;
+    int quantized_drift_check;
+
+    // Sum the gradients of each node's workers before the master (see
+    // node_aggregator.h).
+    bool hierarchical_aggregation;
+
+    // Pick BLAS threads per gemm shape, cached in gemm_tuning_file.
+    bool tune_gemms;
+    string gemm_tuning_file;
+
+    // Run elementwise loops on task_pool threads, one per budgeted cpu,
+    // or per allowed cpu without THREAD_BUDGET.
+    bool parallel_loops;
+
+    // Where the master saves the trained model; empty not to.
+    string model_file;
+
+    // Stragglers for local runs (see fault_injector.h): each step a
+    // worker waits compute_delay before computing and holds each
+    // gradient offer back message_delay. slow_node delays only
+    // slow_ranks, by default the highest rank.
+    DelaySpec compute_delay, message_delay;
+    std::vector<int> slow_ranks;
+    int fault_seed;
+
+    RunConfig() {
+	n_train_iters = N_TRAIN_ITERS;
+	shortcircuit = SHORTCIRCUIT;
+	generate_timeline = GENERATE_TIMELINE;
+	batch_size = 128;
+	micro_batches = MICRO_BATCHES;
+	learning_rate = 1e-3;
+	hidden_layers = ParseLayers("500,500,800,800,200,100,100");
+	n_to_collect = 0;
+	n_backup_workers = 4;
+	master_computes = MASTER_COMPUTES;
+	quantized_evaluation = QUANTIZED_EVALUATION;
+	quantized_drift_check = QUANTIZED_DRIFT_CHECK;
+	hierarchical_aggregation = HIERARCHICAL_AGGREGATION;
+	tune_gemms = TUNE_GEMMS;
+	gemm_tuning_file = "gemm_tuning.txt";
+	parallel_loops = PARALLEL_LOOPS;
+	model_file = "";
+	compute_delay = ParseDelay("none");
+	message_delay = ParseDelay("none");
+	fault_seed = 1;
+    }
+
+    void ParseArgs(int argc, char **argv) {
+	for (int i = 1; i < argc; i++) {
+	    string arg = argv[i];
+	    if (arg.compare(0, 2, "--") != 0) {
+		Invalid("argument", arg);
+	    }
+	    string key = arg.substr(2), value;
+	    size_t equals = key.find('=');
+	    if (equals != string::npos) {
+		value = key.substr(equals+1);
+		key = key.substr(0, equals);
+	    }
+	    else if (i+1 < argc) {
+		value = argv[++i];
+	    }
+	    else {
+		Invalid("argument", arg);
+	    }
+
+	    if (key == "config") {
+		Load(value);
+	    }
+	    else {
+		Set(key, value);
+	    }
+	}
+    }
+
+    void Load(string path) {
+	ifstream file(path);
+	if (!file.is_open()) {
+	    Invalid("config file", path);
+	}
+	string line;
+	while (std::getline(file, line)) {
+	    line = line.substr(0, line.find('#'));
+	    size_t equals = line.find('=');
+	    if (equals == string::npos) {
+		if (Trim(line) != "") Invalid("config line", line);
+		continue;
+	    }
+	    Set(Trim(line.substr(0, equals)), Trim(line.substr(equals+1)));
+	}
+    }
+
+    void Set(string key, string value) {
+	try {
+	    if (key == "n_train_iters") n_train_iters = std::stoi(value);
+	    else if (key == "shortcircuit") shortcircuit = ParseBool(value);
+	    else if (key == "generate_timeline") generate_timeline = ParseBool(value);
+	    else if (key == "batch_size") batch_size = std::stoi(value);
+	    else if (key == "micro_batches") micro_batches = std::stoi(value);
+	    else if (key == "learning_rate") learning_rate = std::stod(value);
+	    else if (key == "hidden_layers") hidden_layers = ParseLayers(value);
+	    else if (key == "conv_layers") conv_layers = ParseConvLayers(value);
+	    else if (key == "n_to_collect") n_to_collect = std::stoi(value);
+	    else if (key == "n_backup_workers") n_backup_workers = std::stoi(value);
+	    else if (key == "master_computes") master_computes = ParseBool(value);
+	    else if (key == "quantized_evaluation") quantized_evaluation = ParseBool(value);
+	    else if (key == "quantized_drift_check") quantized_drift_check = std::stoi(value);
+	    else if (key == "hierarchical_aggregation") hierarchical_aggregation = ParseBool(value);
+	    else if (key == "tune_gemms") tune_gemms = ParseBool(value);
+	    else if (key == "gemm_tuning_file") gemm_tuning_file = value;
+	    else if (key == "parallel_loops") parallel_loops = ParseBool(value);
+	    else if (key == "model_file") model_file = value;
+	    else if (key == "compute_delay") compute_delay = ParseDelay(value);
+	    else if (key == "message_delay") message_delay = ParseDelay(value);
+	    else if (key == "slow_ranks") slow_ranks = ParseLayers(value);
+	    else if (key == "fault_seed") fault_seed = std::stoi(value);
+	    else Invalid("setting", key);
+	}
+	catch (std::logic_error &) {
+	    // std::stoi and std::stod throw on malformed and out of range
+	    // numbers.
+	    Invalid(key, value);
+	}
+    }
+
+    // Settings that only make sense together, checked once the number
+    // of ranks is known. A master collecting more gradients than there
+    // are workers would wait forever.
+    void Validate(int n_procs) {
+	if (batch_size <= 0) Invalid("batch_size", std::to_string(batch_size));
+	if (micro_batches <= 0) Invalid("micro_batches", std::to_string(micro_batches));
+	if (NToCollect(n_procs) > NWorkers(n_procs)) {
+	    Invalid("n_to_collect", std::to_string(NToCollect(n_procs)) + " with " +
+		    std::to_string(NWorkers(n_procs)) + " workers");
+	}
+    }
+
+    // -2 for master and evaluator.
+    int NToCollect(int n_procs) {
+	if (n_to_collect > 0) return n_to_collect;
+	return std::max(1, NWorkers(n_procs) - n_backup_workers);
+    }
+
+    // Ranks computing gradients.
+    int NWorkers(int n_procs) {
+	return n_procs - 2 + (master_computes ? 1 : 0);
+    }
+
+    void Print() {
+	std::cout << "Config: n_train_iters=" << n_train_iters
+		  << " shortcircuit=" << shortcircuit
+		  << " generate_timeline=" << generate_timeline
+		  << " batch_size=" << batch_size
+		  << " micro_batches=" << micro_batches
+		  << " learning_rate=" << learning_rate
+		  << " hidden_layers=";
+	for (int i = 0; i < hidden_layers.size(); i++) {
+	    std::cout << (i ? "," : "") << hidden_layers[i];
+	}
+	std::cout << " conv_layers=";
+	for (int i = 0; i < conv_layers.size(); i++) {
+	    std::cout << (i ? "," : "");
+	    if (conv_layers[i].channels == 0) std::cout << "p" << conv_layers[i].pool;
+	    else std::cout << conv_layers[i].channels << ":" << conv_layers[i].kernel;
+	}
+	std::cout << " n_to_collect=" << n_to_collect
+		  << " n_backup_workers=" << n_backup_workers
+		  << " master_computes=" << master_computes
+		  << " quantized_evaluation=" << quantized_evaluation
+		  << " quantized_drift_check=" << quantized_drift_check
+		  << " hierarchical_aggregation=" << hierarchical_aggregation
+		  << " tune_gemms=" << tune_gemms
+		  << " gemm_tuning_file=" << gemm_tuning_file
+		  << " parallel_loops=" << parallel_loops
+		  << " model_file=" << model_file
+		  << " compute_delay=" << compute_delay.Name()
+		  << " message_delay=" << message_delay.Name()
+		  << " slow_ranks=";
+	for (int i = 0; i < slow_ranks.size(); i++) {
+	    std::cout << (i ? "," : "") << slow_ranks[i];
+	}
+	std::cout << " fault_seed=" << fault_seed << std::endl;
+    }
+
+    bool FaultsInjected() {
+	return compute_delay.kind != "none" || message_delay.kind != "none";
+    }
+
+ protected:
+    static string Trim(string s) {
+	size_t first = s.find_first_not_of(" \t\r");
+	if (first == string::npos) return "";
+	return s.substr(first, s.find_last_not_of(" \t\r") - first + 1);
+    }
+
+    static bool ParseBool(string value) {
+	if (value == "true" || value == "1") return true;
+	if (value == "false" || value == "0") return false;
+	Invalid("boolean", value);
+	return false;
+    }
+
+    static std::vector<int> ParseLayers(string value) {
+	std::vector<int> layers;
+	std::stringstream stream(value);
+	string width;
+	while (std::getline(stream, width, ',')) {
+	    layers.push_back(std::stoi(width));
+	}
+	return layers;
+    }
+
+    static std::vector<ConvSpec> ParseConvLayers(string value) {
+	std::vector<ConvSpec> layers;
+	std::stringstream stream(value);
+	string spec;
+	while (std::getline(stream, spec, ',')) {
+	    size_t colon = spec.find(':');
+	    if (spec[0] == 'p') {
+		layers.push_back({0, 0, std::stoi(spec.substr(1))});
+	    }
+	    else if (colon != string::npos) {
+		layers.push_back({std::stoi(spec.substr(0, colon)), std::stoi(spec.substr(colon+1)), 1});
+	    }
+	    else {
+		Invalid("conv layer", spec);
+	    }
+	}
+	return layers;
+    }
+
+    static DelaySpec ParseDelay(string value) {
+	std::vector<string> fields;
+	std::stringstream stream(value);
+	string field;
+	while (std::getline(stream, field, ':')) {
+	    fields.push_back(field);
+	}
+	DelaySpec spec = {fields.empty() ? "" : fields[0], 0, 0};
+	int n_params = spec.kind == "none" ? 0 : spec.kind == "pareto" ? 2 : 1;
+	if ((spec.kind != "none" && spec.kind != "fixed" && spec.kind != "exponential" &&
+	     spec.kind != "pareto" && spec.kind != "slow_node") || fields.size() != n_params+1) {
+	    Invalid("delay", value);
+	}
+	if (n_params > 0) spec.a = std::stod(fields[1]);
+	if (n_params > 1) spec.b = std::stod(fields[2]);
+	if (spec.a < 0 || (spec.kind == "pareto" && spec.b <= 0)) {
+	    Invalid("delay", value);
+	}
+	return spec;
+    }
+
+    static void Invalid(string what, string value) {
+	std::cout << "Invalid " << what << ": " << value << std::endl;
+	exit(-1);
+    }
+};
+
+RunConfig run_config;
+
+#endif
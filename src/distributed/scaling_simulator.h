@@ -0,0 +1,468 @@
+#ifndef _SCALING_SIMULATOR_
+#define _SCALING_SIMULATOR_
+
+#include <queue>
+#include <deque>
+#include <random>
+#include <fstream>
+#include <sstream>
+#include "distributed_defines.h"
+#include "fault_injector.h"
+
+// The compute times of a run, from the trace_out_<rank> files of
+// step_trace.h: each worker's finished steps, and what adding a gradient
+// and updating cost the master.
+class RecordedRun {
+ public:
+    struct Step {
+	std::vector<double> forward, backward;
+    };
+
+    std::vector<size_t> gradient_counts;
+    std::vector<std::vector<Step> > workers;
+    int n_traced_workers, n_master_steps;
+    double update_millis;
+    std::vector<double> consume_millis;
+    std::vector<long long int> n_consumed;
+
+    RecordedRun() {
+	n_traced_workers = n_master_steps = 0;
+	update_millis = 0;
+    }
+
+    void Load(string path) {
+	std::ifstream file(path);
+	string line, word, role;
+	int version = 0, rank;
+	if (!file.is_open() || !std::getline(file, line) ||
+	    !(std::stringstream(line) >> word >> version >> rank >> role) || word != "trace" || version != 1) {
+	    Invalid(path);
+	}
+	std::vector<size_t> counts;
+	if (!std::getline(file, line)) Invalid(path);
+	std::stringstream header(line);
+	header >> word;
+	size_t count;
+	while (header >> count) {
+	    counts.push_back(count);
+	}
+	if (word != "gradients" || counts.empty() || (!gradient_counts.empty() && counts != gradient_counts)) {
+	    Invalid(path);
+	}
+	gradient_counts = counts;
+	consume_millis.resize(counts.size());
+	n_consumed.resize(counts.size());
+
+	int n_layers = counts.size()+1;
+	std::vector<Step> steps;
+	while (std::getline(file, line)) {
+	    std::stringstream fields(line);
+	    int step;
+	    fields >> word >> step;
+	    if (word == "compute") {
+		double delay;
+		Step recorded;
+		recorded.forward.resize(n_layers);
+		recorded.backward.resize(n_layers);
+		fields >> delay;
+		for (int i = 0; i < n_layers; i++) fields >> recorded.forward[i];
+		for (int i = 0; i < n_layers; i++) fields >> recorded.backward[i];
+		if (!fields) Invalid(path);
+		steps.push_back(recorded);
+	    }
+	    else if (word == "master") {
+		double update;
+		std::vector<int> used(counts.size());
+		fields >> update;
+		for (int l = 0; l < used.size(); l++) fields >> used[l];
+		for (int l = 0; l < used.size(); l++) {
+		    double millis;
+		    fields >> millis;
+		    consume_millis[l] += millis;
+		    n_consumed[l] += used[l];
+		}
+		if (!fields) Invalid(path);
+		update_millis += update;
+		n_master_steps++;
+	    }
+	    else {
+		Invalid(path);
+	    }
+	}
+
+	// A worker whose every step was short circuited, or one that does
+	// not trace (RMA, local SGD), has nothing to go on and is not
+	// counted.
+	if (role == "worker") {
+	    if (steps.empty()) {
+		std::cout << "No finished steps in " << path << ", skipped" << std::endl;
+		return;
+	    }
+	    n_traced_workers++;
+	    workers.push_back(steps);
+	}
+    }
+
+    double UpdateMillis() {
+	return update_millis / std::max(n_master_steps, 1);
+    }
+
+    // Per gradient.
+    double ConsumeMillis(int l) {
+	return consume_millis[l] / std::max(n_consumed[l], 1LL);
+    }
+
+    // The master's update and adding the gradients it used, per step.
+    double MasterMillisPerStep() {
+	double total = update_millis;
+	for (int l = 0; l < consume_millis.size(); l++) {
+	    total += consume_millis[l];
+	}
+	return total / std::max(n_master_steps, 1);
+    }
+
+ protected:
+    static void Invalid(string path) {
+	std::cout << "Invalid trace file: " << path << std::endl;
+	exit(-1);
+    }
+};
+
+// Links between the master and the workers. The master's link carries
+// one message at a time each way, at bytes_per_ms; every message also
+// takes latency_ms. Answering a gradient header costs the master
+// header_ms.
+struct NetworkModel {
+    double latency_ms, bytes_per_ms, header_ms;
+};
+
+// Discrete event simulation of SyncReplicasMasterNN with backup workers
+// at any number of workers, from a RecordedRun.
+//
+// Simulated worker w is rank w+2 and replays the steps of recorded
+// worker w % (workers recorded), drawn at random; injected delays come
+// from run_config as in a real run. A worker waits for each layer's
+// weights before its forward pass and offers each layer's gradient
+// after its backward pass. It learns of a new step latency_ms after the
+// master starts it: offers for older steps are then suppressed, and
+// with run_config.shortcircuit the step it is computing is dropped at
+// the next layer. The master answers headers and adds gradients one at
+// a time, in arrival order, rejecting stale and surplus headers, and
+// updates once every layer has n_to_collect gradients.
+//
+// Not modelled: micro-batches (a step's are replayed as one), node
+// aggregation, shared memory, staleness and the master computing.
+class ScalingSimulator {
+ public:
+    ScalingSimulator(RecordedRun &run, NetworkModel network, int n_workers, int n_to_collect, unsigned seed)
+	: run(run), faults(n_workers+2), random(seed) {
+	this->network = network;
+	this->n_workers = n_workers;
+	this->n_to_collect = n_to_collect;
+	n_layers = run.gradient_counts.size()+1;
+	workers.resize(n_workers);
+	now = 0;
+	n_events = 0;
+    }
+
+    void Run(int n_steps) {
+	this->n_steps = n_steps;
+	cur_step = STEP_START-1;
+	known_step = STEP_UNINITIALIZED;
+	master_busy = false;
+	in_free = out_free = 0;
+	master_busy_millis = 0;
+	n_short_circuits = n_suppressed = n_stale = n_surplus = 0;
+	bytes_received = 0;
+	step_starts.clear();
+	events = std::priority_queue<Event, std::vector<Event>, std::greater<Event> >();
+	master_queue.clear();
+	for (int w = 0; w < n_workers; w++) {
+	    workers[w].step = STEP_UNINITIALIZED;
+	    workers[w].compute_millis = 0;
+	}
+
+	StartMasterStep();
+	while (!events.empty() && cur_step < n_steps) {
+	    Event event = events.top();
+	    events.pop();
+	    now = event.time;
+	    Handle(event);
+	}
+    }
+
+    // Steps the master finished, which may be fewer than asked for if
+    // the simulation ran out of events.
+    int NSteps() {
+	return std::max((int)step_starts.size()-1, 0);
+    }
+
+    double MillisPerStep() {
+	return Elapsed() / NSteps();
+    }
+
+    double MasterUtilization() {
+	return master_busy_millis / Elapsed();
+    }
+
+    double WorkerUtilization() {
+	double compute = 0;
+	for (int w = 0; w < n_workers; w++) {
+	    compute += workers[w].compute_millis;
+	}
+	return compute / (n_workers * Elapsed());
+    }
+
+    void Print() {
+	if (NSteps() == 0) {
+	    std::cout << n_workers << " workers collecting " << n_to_collect << ": no step finished" << std::endl;
+	    return;
+	}
+	if (cur_step < n_steps) {
+	    std::cout << n_workers << " workers collecting " << n_to_collect << ": stalled after "
+		      << NSteps() << " steps" << std::endl;
+	}
+	double n = NSteps();
+	std::cout << n_workers << " workers collecting " << n_to_collect << ": "
+		  << MillisPerStep() << " ms per step, master " << 100 * MasterUtilization() << "% busy, workers "
+		  << 100 * WorkerUtilization() << "% busy; per step " << n_short_circuits / n << " short circuits, "
+		  << n_suppressed / n << " offers suppressed, " << n_stale / n << " stale and "
+		  << n_surplus / n << " surplus headers, " << bytes_received / n << " gradient bytes" << std::endl;
+    }
+
+ protected:
+    enum EventType { STEP_NOTIFIED, PHASE_DONE, HEADER_ARRIVES, DATA_ARRIVES, MASTER_DONE };
+    enum JobType { HEADER_JOB, DATA_JOB, UPDATE_JOB };
+
+    struct Event {
+	double time;
+	long long int seq;
+	int type, worker, step, phase;
+
+	bool operator>(const Event &other) const {
+	    return time > other.time || (time == other.time && seq > other.seq);
+	}
+    };
+
+    struct Job {
+	int type, worker, step, layer;
+	bool accepted;
+    };
+
+    // Phase 0 is the injected delay, 1..n_layers the forward pass and
+    // n_layers+1..2*n_layers the backward pass, last layer first.
+    // weight_arrivals[l] is when the step's layer l weights arrive.
+    struct Worker {
+	int step, phase;
+	RecordedRun::Step *sample;
+	std::vector<double> weight_arrivals;
+	double compute_millis;
+    };
+
+    RecordedRun &run;
+    NetworkModel network;
+    FaultInjector faults;
+    std::mt19937 random;
+    int n_workers, n_to_collect, n_layers, n_steps;
+
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event> > events;
+    long long int n_events;
+    double now;
+    std::vector<Worker> workers;
+
+    // Master. known_step is the newest step the workers know of, and
+    // weight_arrivals[w][l] when worker w has layer l of its weights.
+    int cur_step, known_step;
+    std::vector<int> accepted, accumulated;
+    std::deque<Job> master_queue;
+    Job current_job;
+    bool master_busy;
+    double in_free, out_free;
+    std::vector<std::vector<double> > weight_arrivals, next_weight_arrivals;
+    std::vector<double> step_starts;
+
+    double master_busy_millis, bytes_received;
+    long long int n_short_circuits, n_suppressed, n_stale, n_surplus;
+
+    double Elapsed() {
+	return step_starts.back() - step_starts.front();
+    }
+
+    void Schedule(double time, int type, int worker = -1, int step = 0, int phase = 0) {
+	events.push({time, n_events++, type, worker, step, phase});
+    }
+
+    void Handle(Event &event) {
+	switch (event.type) {
+	case STEP_NOTIFIED:
+	    StepNotified(event.step);
+	    break;
+	case PHASE_DONE:
+	    PhaseDone(event.worker, event.step, event.phase);
+	    break;
+	case HEADER_ARRIVES:
+	    Enqueue({HEADER_JOB, event.worker, event.step, event.phase, false});
+	    break;
+	case DATA_ARRIVES:
+	    Enqueue({DATA_JOB, event.worker, event.step, event.phase, false});
+	    break;
+	case MASTER_DONE:
+	    MasterDone();
+	    break;
+	}
+    }
+
+    // Weights go out layer by layer, to every worker in turn.
+    void StartMasterStep() {
+	cur_step++;
+	step_starts.push_back(now);
+	accepted.assign(n_layers-1, 0);
+	accumulated.assign(n_layers-1, 0);
+	next_weight_arrivals.assign(n_workers, std::vector<double>(n_layers-1));
+	for (int l = 0; l < n_layers-1; l++) {
+	    for (int w = 0; w < n_workers; w++) {
+		out_free = std::max(out_free, now) + Bytes(l) / network.bytes_per_ms;
+		next_weight_arrivals[w][l] = out_free + network.latency_ms;
+	    }
+	}
+	Schedule(now + network.latency_ms, STEP_NOTIFIED, -1, cur_step);
+    }
+
+    void StepNotified(int step) {
+	known_step = step;
+	weight_arrivals = next_weight_arrivals;
+	for (int w = 0; w < n_workers; w++) {
+	    Worker &worker = workers[w];
+	    if (worker.step == STEP_UNINITIALIZED) {
+		StartStep(w);
+	    }
+
+	    // An injected delay polls for new steps.
+	    else if (worker.phase == 0 && run_config.shortcircuit) {
+		n_short_circuits++;
+		StartStep(w);
+	    }
+	}
+    }
+
+    void StartStep(int w) {
+	Worker &worker = workers[w];
+	std::vector<RecordedRun::Step> &steps = run.workers[w % run.workers.size()];
+	worker.step = known_step;
+	worker.weight_arrivals = weight_arrivals[w];
+	worker.sample = &steps[random() % steps.size()];
+	worker.phase = 0;
+	Schedule(now + faults.ComputeDelayMillis(w+2, known_step), PHASE_DONE, w, known_step, 0);
+    }
+
+    void PhaseDone(int w, int step, int phase) {
+	Worker &worker = workers[w];
+	if (worker.step != step || worker.phase != phase) return;
+
+	int backward_layer = 2*n_layers - phase;
+	if (phase > n_layers && backward_layer < n_layers-1) {
+	    Offer(w, step, backward_layer);
+	}
+	if (phase == 2*n_layers) {
+	    worker.step = STEP_UNINITIALIZED;
+	    if (known_step > step) {
+		StartStep(w);
+	    }
+	    return;
+	}
+	if (run_config.shortcircuit && known_step > step) {
+	    n_short_circuits++;
+	    StartStep(w);
+	    return;
+	}
+
+	worker.phase = ++phase;
+	double start = now, duration;
+	if (phase <= n_layers) {
+	    int l = phase-1;
+	    if (l < n_layers-1) {
+		start = std::max(start, worker.weight_arrivals[l]);
+	    }
+	    duration = worker.sample->forward[l];
+	}
+	else {
+	    duration = worker.sample->backward[2*n_layers - phase];
+	}
+	worker.compute_millis += duration;
+	Schedule(start + duration, PHASE_DONE, w, step, phase);
+    }
+
+    void Offer(int w, int step, int l) {
+	if (known_step > step) {
+	    n_suppressed++;
+	    return;
+	}
+	Schedule(now + faults.MessageDelayMillis(w+2, step, l) + network.latency_ms, HEADER_ARRIVES, w, step, l);
+    }
+
+    void Enqueue(Job job) {
+	master_queue.push_back(job);
+	if (!master_busy) {
+	    StartMasterJob();
+	}
+    }
+
+    void StartMasterJob() {
+	if (master_queue.empty()) {
+	    master_busy = false;
+	    return;
+	}
+	master_busy = true;
+	current_job = master_queue.front();
+	master_queue.pop_front();
+	Job &job = current_job;
+	double cost;
+	if (job.type == HEADER_JOB) {
+	    job.accepted = job.step == cur_step && accepted[job.layer] < n_to_collect;
+	    if (job.accepted) accepted[job.layer]++;
+	    else if (job.step < cur_step) n_stale++;
+	    else n_surplus++;
+	    cost = network.header_ms;
+	}
+	else {
+	    cost = run.ConsumeMillis(job.layer);
+	}
+	master_busy_millis += cost;
+	Schedule(now + cost, MASTER_DONE);
+    }
+
+    void MasterDone() {
+	Job &job = current_job;
+	if (job.type == HEADER_JOB && job.accepted) {
+	    in_free = std::max(in_free, now + network.latency_ms) + Bytes(job.layer) / network.bytes_per_ms;
+	    bytes_received += Bytes(job.layer);
+	    Schedule(in_free + network.latency_ms, DATA_ARRIVES, job.worker, job.step, job.layer);
+	}
+	else if (job.type == DATA_JOB) {
+	    accumulated[job.layer]++;
+	    if (StepComplete()) {
+		job.type = UPDATE_JOB;
+		master_busy_millis += run.UpdateMillis();
+		Schedule(now + run.UpdateMillis(), MASTER_DONE);
+		return;
+	    }
+	}
+	else if (job.type == UPDATE_JOB) {
+	    StartMasterStep();
+	}
+	StartMasterJob();
+    }
+
+    bool StepComplete() {
+	for (int l = 0; l < n_layers-1; l++) {
+	    if (accumulated[l] < n_to_collect) return false;
+	}
+	return true;
+    }
+
+    double Bytes(int l) {
+	return sizeof(double) * run.gradient_counts[l];
+    }
+};
+
+#endif
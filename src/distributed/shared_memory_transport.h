@@ -0,0 +1,142 @@
+#ifndef _SHARED_MEMORY_TRANSPORT_
+#define _SHARED_MEMORY_TRANSPORT_
+
+#include "distributed_defines.h"
+
+// Node local fast path between the master and the workers it shares a
+// node with, built on an MPI-3 shared memory window.
+//
+// The master's segment holds n_versions copies of all layer weights,
+// each preceded by the step it holds. Weights for step s are published
+// to version s % n_versions, so workers can read them in place while
+// the master publishes newer steps to the other versions. Each worker's
+// segment holds one gradient slot per layer, which the worker computes
+// into and the master sums from directly. Ordering still comes from the
+// step announcements and the gradient headers and replies, with
+// MPI_Win_sync on both sides of each.
+//
+// Ranks on other nodes, and the evaluator, keep the point to point path.
+class SharedMemoryTransport {
+ public:
+    SharedMemoryTransport(MPI_Comm comm, std::vector<size_t> layer_counts, int n_versions) {
+	this->layer_counts = layer_counts;
+	this->n_versions = n_versions;
+	enabled = false;
+	win = MPI_WIN_NULL;
+
+	int rank;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node_comm);
+
+	// Only the master's node has anything to share.
+	int is_master = rank == MASTER_RANK, master_here = 0;
+	MPI_Allreduce(&is_master, &master_here, 1, MPI_INT, MPI_MAX, node_comm);
+	if (!master_here) {
+	    MPI_Comm_free(&node_comm);
+	    return;
+	}
+	enabled = true;
+
+	int local_size;
+	MPI_Comm_size(node_comm, &local_size);
+	node_ranks.resize(local_size);
+	MPI_Allgather(&rank, 1, MPI_INT, node_ranks.data(), 1, MPI_INT, node_comm);
+
+	offsets.push_back(0);
+	for (int i = 0; i < layer_counts.size(); i++) {
+	    offsets.push_back(offsets.back() + layer_counts[i]);
+	}
+	size_t model_count = offsets.back();
+
+	size_t segment_count = 0;
+	if (rank == MASTER_RANK) {
+	    segment_count = n_versions * (model_count + 1);
+	}
+	else if (rank != EVALUATOR_RANK) {
+	    segment_count = model_count;
+	}
+
+	double *segment;
+	MPI_Win_allocate_shared(sizeof(double) * segment_count, sizeof(double), MPI_INFO_NULL,
+				node_comm, &segment, &win);
+	MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+
+	segments.resize(local_size);
+	for (int i = 0; i < local_size; i++) {
+	    MPI_Aint size;
+	    int disp_unit;
+	    MPI_Win_shared_query(win, i, &size, &disp_unit, &segments[i]);
+	}
+
+	memset(segment, 0, sizeof(double) * segment_count);
+	if (rank == MASTER_RANK) {
+	    for (int v = 0; v < n_versions; v++) {
+		*VersionStep(v) = STEP_UNINITIALIZED;
+	    }
+	}
+	Sync();
+	MPI_Barrier(node_comm);
+    }
+
+    // Collective over the node, like the constructor.
+    ~SharedMemoryTransport() {
+	if (!enabled) return;
+	MPI_Win_unlock_all(win);
+	MPI_Win_free(&win);
+	MPI_Comm_free(&node_comm);
+    }
+
+    // Whether world_rank can use the fast path with the master.
+    bool IsLocal(int world_rank) {
+	return enabled && world_rank != EVALUATOR_RANK && LocalRank(world_rank) >= 0;
+    }
+
+    double *Weights(int step, int layer) {
+	int version = step % n_versions;
+	return &MasterSegment()[version * (offsets.back() + 1) + 1 + offsets[layer]];
+    }
+
+    // The step the version for `step` currently holds.
+    double *VersionStep(int step) {
+	return &MasterSegment()[(step % n_versions) * (offsets.back() + 1)];
+    }
+
+    double *Gradient(int world_rank, int layer) {
+	return &((double *)segments[LocalRank(world_rank)])[offsets[layer]];
+    }
+
+    // Master: copy the weights of `step` into their version.
+    void PublishWeights(int step, int layer, double *weights) {
+	memcpy(Weights(step, layer), weights, sizeof(double) * layer_counts[layer]);
+	*VersionStep(step) = step;
+    }
+
+    // Make our stores visible to, and pick up stores from, the other
+    // ranks on the node. Call before sending and after receiving the
+    // message that orders them.
+    void Sync() {
+	MPI_Win_sync(win);
+    }
+
+ protected:
+    bool enabled;
+    int n_versions;
+    MPI_Comm node_comm;
+    MPI_Win win;
+    std::vector<int> node_ranks;
+    std::vector<void *> segments;
+    std::vector<size_t> layer_counts, offsets;
+
+    int LocalRank(int world_rank) {
+	for (int i = 0; i < node_ranks.size(); i++) {
+	    if (node_ranks[i] == world_rank) return i;
+	}
+	return -1;
+    }
+
+    double *MasterSegment() {
+	return (double *)segments[LocalRank(MASTER_RANK)];
+    }
+};
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef _STEP_NOTIFIER_
+#define _STEP_NOTIFIER_
+
+#include "distributed_defines.h"
+
+// Step announcements as a counter each worker holds in its own memory.
+//
+// Every rank exposes one int in an RMA window. The master writes a new
+// step into each worker's int with an atomic MPI_Accumulate (REPLACE) and
+// flushes, so the announcement costs no receive on the worker and no
+// request on either side. A worker asking whether the step changed reads
+// its int: an atomic load, cheap enough to check inside long layers.
+// Poll() adds an MPI_Win_sync to make sure the latest write is seen, and
+// gives the library a chance to progress it.
+//
+// Collective over comm, construction and destruction alike.
+class StepNotifier {
+ public:
+    StepNotifier(MPI_Comm comm) {
+	MPI_Comm_rank(comm, &rank);
+	MPI_Win_allocate(sizeof(int), sizeof(int), MPI_INFO_NULL, comm, &step, &win);
+	*step = STEP_UNINITIALIZED;
+	MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+	MPI_Win_sync(win);
+	MPI_Barrier(comm);
+    }
+
+    ~StepNotifier() {
+	MPI_Win_unlock_all(win);
+	MPI_Win_free(&win);
+    }
+
+    // Master: announce `new_step` to `ranks`.
+    void Publish(int new_step, std::vector<int> &ranks) {
+	published = new_step;
+	for (int i = 0; i < ranks.size(); i++) {
+	    MPI_Accumulate(&published, 1, MPI_INT, ranks[i], 0, 1, MPI_INT, MPI_REPLACE, win);
+	}
+	MPI_Win_flush_all(win);
+    }
+
+    // Worker: the last step announced, as far as we have seen.
+    int Latest() {
+	return __atomic_load_n(step, __ATOMIC_ACQUIRE);
+    }
+
+    int Poll() {
+	MPI_Win_sync(win);
+	return Latest();
+    }
+
+ protected:
+    int rank, published;
+    int *step;
+    MPI_Win win;
+};
+
+#endif
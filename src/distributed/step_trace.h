@@ -0,0 +1,117 @@
+#ifndef _STEP_TRACE_
+#define _STEP_TRACE_
+
+#include <chrono>
+#include <fstream>
+#include "distributed_defines.h"
+
+// A rank's compute times per step, written next to the master's timeline
+// when run_config.generate_timeline is set, for simulator_nn. Each rank
+// writes outfiles/trace_out_<rank>:
+//
+//   trace 1 <rank> worker|master
+//   gradients <doubles per weighted layer>
+//   compute <step> <injected delay ms> <forward ms per layer> <backward ms per layer>
+//   master <step> <update ms> <gradients used per weighted layer> <ms adding them per weighted layer>
+//
+// Workers write a compute line for each step they finish, summed over
+// its micro-batches; short circuited steps are left out. The master's
+// update time covers applying the step and sending out its weights.
+class StepTrace {
+ public:
+    StepTrace(int rank, string role, std::vector<NNLayer *> &layers) {
+	n_layers = layers.size();
+	forward.resize(n_layers);
+	backward.resize(n_layers);
+	used.resize(n_layers-1);
+	consume.resize(n_layers-1);
+	Clear();
+	if (!run_config.generate_timeline) return;
+
+	out.open("outfiles/trace_out_" + std::to_string(rank));
+	out << "trace 1 " << rank << " " << role << std::endl << "gradients";
+	for (int i = 0; i < n_layers-1; i++) {
+	    out << " " << layers[i]->GetLayerCount();
+	}
+	out << std::endl;
+    }
+
+    ~StepTrace() {
+	out.close();
+    }
+
+    bool Enabled() {
+	return out.is_open();
+    }
+
+    // Milliseconds, finer than GetTimeMillis().
+    static double Now() {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void Forward(int l, double start) {
+	forward[l] += Now() - start;
+    }
+
+    void Backward(int l, double start) {
+	backward[l] += Now() - start;
+    }
+
+    void Delay(double millis) {
+	delay += millis;
+    }
+
+    void Consume(int l, int count, double start) {
+	used[l] += count;
+	consume[l] += Now() - start;
+    }
+
+    void Update(double start) {
+	update += Now() - start;
+    }
+
+    void EndCompute(int step) {
+	if (Enabled()) {
+	    out << "compute " << step << " " << delay;
+	    Write(forward);
+	    Write(backward);
+	    out << std::endl;
+	}
+	Clear();
+    }
+
+    void EndMaster(int step) {
+	if (Enabled()) {
+	    out << "master " << step << " " << update;
+	    for (int l = 0; l < used.size(); l++) {
+		out << " " << used[l];
+	    }
+	    Write(consume);
+	    out << std::endl;
+	}
+	Clear();
+    }
+
+    void Clear() {
+	delay = update = 0;
+	std::fill(forward.begin(), forward.end(), 0);
+	std::fill(backward.begin(), backward.end(), 0);
+	std::fill(used.begin(), used.end(), 0);
+	std::fill(consume.begin(), consume.end(), 0);
+    }
+
+ protected:
+    int n_layers;
+    ofstream out;
+    double delay, update;
+    std::vector<double> forward, backward, consume;
+    std::vector<int> used;
+
+    void Write(std::vector<double> &millis) {
+	for (int i = 0; i < millis.size(); i++) {
+	    out << " " << millis[i];
+	}
+    }
+};
+
+#endif
@@ -2,35 +2,80 @@
 #define _SYNC_REPLICAS_MASTER_NN_
 
 #include "distributed_defines.h"
+#include "backup_worker_tuner.h"
+#include "shared_memory_transport.h"
+#include "step_notifier.h"
+#include "master_gradient_worker.h"
+#include "weight_versions.h"
+#include "fault_injector.h"
+#include "step_trace.h"
 
 class SyncReplicasMasterNN : public NN {
  public:
-   SyncReplicasMasterNN(NNParams *params, std::vector<MPI_Comm> &layer_comms, int n_procs, int n_to_collect) : NN(params), layer_comms(layer_comms) {
+   SyncReplicasMasterNN(NNParams *params, std::vector<MPI_Comm> &layer_comms, int n_procs, int n_to_collect,
+			string scheme_name = "SyncReplicasWithBackup") : NN(params), layer_comms(layer_comms), faults(n_procs), trace(MASTER_RANK, "master", layers) {
 	this->comm = MPI_COMM_WORLD;
 	this->n_to_collect = n_to_collect;
 	this->n_procs = n_procs;
 	this->cur_step = STEP_START;
-	layer_send_requests.resize(layers.size());
-	for (int i = 0; i < layers.size(); i++) {
-	    for (int j = 0; j < n_procs; j++) {
-		layer_send_requests[i].push_back(MPI_REQUEST_NULL);
-	    }
+	this->params = params;
+	// Weights are sent from versions copied aside, so the layers can be
+	// updated while sends are in flight.
+	for (int i = 0; i < layers.size()-1; i++) {
+	    weight_versions.push_back(new WeightVersions(layers[i]->GetLayerCount(), n_procs));
+	    weight_versions[i]->Reserve(N_WEIGHT_VERSIONS);
+	    current_version.push_back(-1);
 	}
 
-	// Preallocate memory for gradient buffers for irecv.
+	// Preallocate memory for gradient buffers for irecv, and the number
+	// of gradients summed in the one each will receive.
 	for (int i = 0; i < layers.size()-1; i++) {
 	    grad_buffers.push_back(std::vector<double *>());
+	    grad_buffer_counts.push_back(std::vector<int>(N_RECV_REQUESTS_PER_LAYER, 1));
 	    for (int j = 0; j < N_RECV_REQUESTS_PER_LAYER; j++) {
 		grad_buffers[i].push_back((double *)malloc(sizeof(double) * layers[i]->GetLayerCount()));
 	    }
 	}
 
+	// Headers are (step, number of gradients summed) pairs. Reply
+	// buffers, one per (layer, rank) since a worker has at most one
+	// header in flight per layer.
+	gradient_header_buffers.resize((layers.size()-1) * 2);
+	gradient_reply_buffers.resize(layers.size()-1);
+	for (int i = 0; i < layers.size()-1; i++) {
+	    gradient_reply_buffers[i].resize(n_procs * 2);
+	}
+
+	bytes_received = bytes_wasted = bytes_shared = 0;
+	headers_rejected = sums_received = gradients_in_sums = 0;
+	gradients_applied = 0;
+	transport = NULL;
+	notifier = NULL;
+	local_worker = NULL;
+	local_step = STEP_UNINITIALIZED;
+	local_gradients_used = 0;
+	for (int i = 0; i < n_procs; i++) {
+	    if (i != MASTER_RANK && i != EVALUATOR_RANK) {
+		worker_ranks.push_back(i);
+	    }
+	}
+	step_broadcast_reqs.resize(n_procs, MPI_REQUEST_NULL);
+
+	tuner = NULL;
+	if (ADAPTIVE_N_TO_COLLECT) {
+	    tuner = new BackupWorkerTuner(std::max(1, MIN_N_TO_COLLECT),
+					  std::min(run_config.NWorkers(n_procs), MAX_N_TO_COLLECT));
+	}
+
+	evaluator_snapshot_pending = false;
+	evaluator_last_step = STEP_UNINITIALIZED;
+
 	// Set gradients to 0
 	for (int i = 0; i < layers.size()-1; i++) {
 	    memset(layers[i]->GetGradient(), 0, sizeof(double) * layers[i]->GetLayerCount());
 	}
 
-	name = scheme_full_name("SyncReplicasWithBackup", n_to_collect, n_procs);
+	name = scheme_full_name(scheme_name, n_to_collect, n_procs);
 
 	// -2 for evaluator and master.
 	timeline_out.open("outfiles/timeline_out_" + name);
@@ -41,170 +86,606 @@ class SyncReplicasMasterNN : public NN {
 
     ~SyncReplicasMasterNN() {
 	timeline_out.close();
+	delete tuner;
+	for (int i = 0; i < weight_versions.size(); i++) {
+	    delete weight_versions[i];
+	}
+    }
+
+    // Exchange weights and gradients with co-located workers through
+    // shared memory instead of messages.
+    void UseSharedMemory(SharedMemoryTransport *transport) {
+	this->transport = transport;
+    }
+
+    // Gradients accepted but never sent, because the worker quit first,
+    // leave their receives posted. Called once every worker is done.
+    void CancelGradientFetches() {
+	for (int i = 0; i < gradient_fetch_requests.size(); i++) {
+	    if (gradient_fetch_requests[i] != MPI_REQUEST_NULL) {
+		MPI_Cancel(&gradient_fetch_requests[i]);
+		MPI_Wait(&gradient_fetch_requests[i], MPI_STATUS_IGNORE);
+	    }
+	}
+    }
+
+    // Announce steps through a counter in each worker's memory instead
+    // of a message per worker per step.
+    void UseStepNotifier(StepNotifier *notifier) {
+	this->notifier = notifier;
     }
 
     void Train(uchar **data, uchar *labels, int examples) override {
 
-	std::vector<int> gradients_accumulated(layers.size());
+	// Gradients used for cur_step, and the ones accepted through the
+	// control channel for it, including those still in flight.
+	gradients_accumulated.resize(layers.size());
 	std::fill(gradients_accumulated.begin(),
 		  gradients_accumulated.end(),
 		  0);
+	gradients_accepted.resize(layers.size());
+	std::fill(gradients_accepted.begin(),
+		  gradients_accepted.end(),
+		  0);
+
+	if (run_config.master_computes && examples > 0) {
+	    local_worker = new MasterGradientWorker(params, data, labels, examples);
+	}
 
 	AsynchronousFetchGradientsStart();
 
 	start_training_time = GetTimeMillis();
 
-	while (cur_step < N_TRAIN_ITERS) {
-	    AsynchronousBroadcastStep();
+	while (cur_step < run_config.n_train_iters) {
+	    if (tuner) {
+		tuner->RecordStepStart(cur_step);
+		n_to_collect = tuner->Choose(cur_step, n_to_collect);
+		std::cout << "Step " << cur_step << " collecting " << n_to_collect << std::endl;
+	    }
+
+	    // Weights go out before the step, so that a worker reading
+	    // them from shared memory never sees the step first.
+	    double update_start = StepTrace::Now();
 	    AsynchronousBroadcastLayerWeights();
+	    AsynchronousBroadcastStep();
+	    trace.Update(update_start);
+	    MaybeSendEvaluatorSnapshot();
+	    StartLocalGradient();
 
-#if GENERATE_TIMELINE
-	    LogReceptionEvent(cur_step, 1);
-#endif
+	    if (run_config.generate_timeline) {
+		LogReceptionEvent(cur_step, 1);
+	    }
 
-	    bool enough_gradients_received = false;
-	    while (!enough_gradients_received) {
+	    while (!StepComplete()) {
+
+		if (ConsumeLocalGradient()) {
+		    continue;
+		}
 
 		// While we don't have enough gradients, keep waiting to receive them.
 		int index_received = -1;
 		MPI_Status stat;
-		MPI_Waitany((layers.size()-1) * N_RECV_REQUESTS_PER_LAYER,
-			    gradient_fetch_requests.data(),
-			    &index_received,
-			    &stat);
+		if (!WaitGradientMessage(&index_received, &stat)) {
+		    continue;
+		}
+
+		// Gradient headers and snapshot requests are answered inline.
+		if (HandleControlMessage(index_received, stat)) {
+		    continue;
+		}
 
 		// We push N_RECV_REQUESTS_PER_LAYER per layer. The layer is
 		// index / N_RECV_REQUESTS_PER_LAYER
 		int layer_received = index_received / N_RECV_REQUESTS_PER_LAYER;
 		int copy_index = index_received - layer_received * N_RECV_REQUESTS_PER_LAYER;
 
-#if GENERATE_TIMELINE
-		LogReceptionEvent(stat.MPI_TAG, 0);
-#endif
-
-		if (stat.MPI_TAG == cur_step) {
-
-		    int count = 0;
-		    MPI_Get_count(&stat, MPI_DOUBLE, &count);
-		    assert(count == layers[layer_received]->GetLayerCount());
-
-		    gradients_accumulated[layer_received]++;
-
-		    // Sum gradient
-		    //layers[layer_received]->ApplyGrad(learning_rate, grad_buffers[layer_received][copy_index]);
-		    MatrixAdd(grad_buffers[layer_received][copy_index], layers[layer_received]->GetGradient(), layers[layer_received]->GetGradient(),
-			      1, 1,
-			      layers[layer_received]->NRows(),
-			      layers[layer_received]->NCols(),
-			      layers[layer_received]->NCols(),
-			      layers[layer_received]->NCols(),
-			      layers[layer_received]->NCols());
-
-		    memset(grad_buffers[layer_received][copy_index], 0, sizeof(double) * layers[layer_received]->GetLayerCount());
-
-		    enough_gradients_received = true;
-		    for (int i = 0; i < layers.size()-1; i++) {
-			enough_gradients_received = enough_gradients_received && gradients_accumulated[i] >= n_to_collect;
-		    }
+		if (run_config.generate_timeline) {
+		    LogReceptionEvent(stat.MPI_TAG, 0, stat.MPI_SOURCE, layer_received);
+		}
 
-		    std::cout << "Gradients accumulated: ";
-		    for (int i = 0; i < layers.size(); i++) {
-			std::cout << gradients_accumulated[i] << " ";
-		    }
-		    std::cout << endl;
+		int count = 0;
+		MPI_Get_count(&stat, MPI_DOUBLE, &count);
+		bytes_received += sizeof(double) * count;
+		assert(count == layers[layer_received]->GetLayerCount());
 
+		if (!ConsumeGradient(layer_received, stat.MPI_TAG, grad_buffers[layer_received][copy_index],
+				     grad_buffer_counts[layer_received][copy_index])) {
+		    bytes_wasted += sizeof(double) * count;
 		}
 
-		// Received a gradient for this layer... Initiate a new
-		// request to receive another one at the layer for the specific copy index.
-		AsynchronousFetchGradient(layer_received, copy_index, &gradient_fetch_requests[index_received]);
+		// The slot's request is now MPI_REQUEST_NULL and may be
+		// handed to the next accepted header.
 	    }
 
-	    // Apply average gradient
-	    for (int layer = 0; layer < layers.size()-1; layer++) {
-		layers[layer]->ApplyGrad(learning_rate / gradients_accumulated[layer],
-					 layers[layer]->GetGradient());
-		memset(layers[layer]->GetGradient(), 0, sizeof(double) * layers[layer]->GetLayerCount());
-	    }
+	    update_start = StepTrace::Now();
+	    FinishStep();
+	    trace.Update(update_start);
+	    trace.EndMaster(cur_step);
+	    gradients_applied += gradients_accumulated[0];
 
 	    std::fill(gradients_accumulated.begin(),
 		      gradients_accumulated.end(), 0);
+	    std::fill(gradients_accepted.begin(),
+		      gradients_accepted.end(), 0);
 
 	    cur_step++;
 	}
 
 	AsynchronousBroadcastStep();
+	MPI_Waitall(step_broadcast_reqs.size(), step_broadcast_reqs.data(), MPI_STATUSES_IGNORE);
+	AsynchronousFetchGradientHeadersCancel();
+	FinishEvaluatorSnapshots();
+	WaitWeightSends();
+	PrintCommunicationStats();
+	PrintThroughput();
+	if (local_worker) {
+	    std::cout << "Master gradients computed: " << local_worker->NComputed()
+		      << " used: " << local_gradients_used << std::endl;
+	    delete local_worker;
+	    local_worker = NULL;
+	}
     }
 
  protected:
-    MPI_Request step_broadcast_req;
+    // One step message in flight per worker, all sent from step_buffer.
+    std::vector<MPI_Request> step_broadcast_reqs;
+    int step_buffer;
+    std::vector<int> worker_ranks;
+    StepNotifier *notifier;
+    NNParams *params;
+
+    // Computes the master's own gradients when run_config.master_computes
+    // is set, NULL otherwise. local_step is the last step it was started
+    // for.
+    MasterGradientWorker *local_worker;
+    int local_step;
+    long long int local_gradients_used;
     int n_procs, cur_step, n_to_collect;
     double start_training_time;
     string name;
     ofstream timeline_out;
     MPI_Comm comm;
-    std::vector<std::vector<MPI_Request> > layer_send_requests;
+
+    // Copies of each layer's weights on their way to workers and the
+    // evaluator, and the one holding cur_step (-1 before the first).
+    std::vector<WeightVersions *> weight_versions;
+    std::vector<int> current_version;
     std::vector<MPI_Request> gradient_fetch_requests;
     std::vector<MPI_Comm> &layer_comms;
     std::vector<std::vector<double *> > grad_buffers;
+    std::vector<std::vector<int> > grad_buffer_counts;
+    std::vector<int> gradient_header_buffers;
+    int snapshot_step;
+    std::vector<std::vector<int> > gradient_reply_buffers;
+    long long int bytes_received, bytes_wasted, bytes_shared, headers_rejected;
+
+    // Headers offering more than one gradient, from node leaders, and
+    // the gradients they offered.
+    long long int sums_received, gradients_in_sums;
+
+    // Gradients that went into steps, counted on the first layer.
+    long long int gradients_applied;
+    SharedMemoryTransport *transport;
+    std::vector<int> gradients_accumulated, gradients_accepted;
+
+    // The evaluator asks for weights when it is ready for them, naming
+    // the last step it has. Its request is held until we have a newer one.
+    bool evaluator_snapshot_pending;
+    int evaluator_last_step;
+
+    // Tunes n_to_collect from worker arrival times when
+    // ADAPTIVE_N_TO_COLLECT is set, NULL otherwise.
+    BackupWorkerTuner *tuner;
+
+    // The delays injected into workers, for the timeline.
+    FaultInjector faults;
+
+    // Time spent adding gradients and updating, for simulator_nn.
+    StepTrace trace;
+
+    // Sum a gradient for cur_step, itself the sum of count workers'
+    // gradients, into the layer's gradient. Returns false if the
+    // gradient was not used.
+    virtual bool ConsumeGradient(int l, int step, double *gradient, int count = 1) {
+	if (step != cur_step) {
+	    return false;
+	}
+
+	gradients_accumulated[l] += count;
+	double start = StepTrace::Now();
+	MatrixAdd(gradient, layers[l]->GetGradient(), layers[l]->GetGradient(),
+		  1, 1,
+		  layers[l]->NRows(),
+		  layers[l]->NCols(),
+		  layers[l]->NCols(),
+		  layers[l]->NCols(),
+		  layers[l]->NCols());
+	trace.Consume(l, count, start);
+
+	std::cout << "Gradients accumulated: ";
+	for (int i = 0; i < layers.size(); i++) {
+	    std::cout << gradients_accumulated[i] << " ";
+	}
+	std::cout << endl;
+	return true;
+    }
+
+    // Start the master's gradient for cur_step if it has none yet and its
+    // thread is free. One that is still busy is picked up next time.
+    void StartLocalGradient() {
+	if (local_worker && local_step < cur_step && local_worker->Start(cur_step, layers)) {
+	    local_step = cur_step;
+	}
+    }
+
+    // Offer the master's finished gradient to each layer like a worker's
+    // header. Returns true if there was one.
+    bool ConsumeLocalGradient() {
+	if (!local_worker) {
+	    return false;
+	}
+	int step = local_worker->Ready();
+	if (step == STEP_UNINITIALIZED) {
+	    return false;
+	}
+	bool used = false;
+	for (int l = 0; l < layers.size()-1; l++) {
+	    if (AcceptGradient(l, step)) {
+		gradients_accepted[l]++;
+		used = ConsumeGradient(l, step, local_worker->Gradient(l)) || used;
+	    }
+	}
+	local_gradients_used += used;
+	local_worker->Release();
+	StartLocalGradient();
+	return true;
+    }
+
+    // Wait for the next gradient request to complete. While the master's
+    // own gradient is being computed, poll with a short backoff instead,
+    // giving up the core, and return false once the gradient is ready.
+    // Busy is checked before Ready: a gradient that finished since
+    // ConsumeLocalGradient looked may be the one the step still needs.
+    bool WaitGradientMessage(int *index_received, MPI_Status *stat) {
+	if (!local_worker || (!local_worker->Busy() && local_worker->Ready() == STEP_UNINITIALIZED)) {
+	    MPI_Waitany(gradient_fetch_requests.size(), gradient_fetch_requests.data(),
+			index_received, stat);
+	    return true;
+	}
+	if (!local_worker->Busy()) {
+	    return false;
+	}
+	int flag = 0, backoff_us = 1;
+	while (true) {
+	    MPI_Testany(gradient_fetch_requests.size(), gradient_fetch_requests.data(),
+			index_received, &flag, stat);
+	    if (flag) {
+		return true;
+	    }
+	    if (!local_worker->Busy()) {
+		return false;
+	    }
+	    usleep(backoff_us);
+	    backoff_us = std::min(backoff_us * 2, MASTER_POLL_MAX_US);
+	}
+    }
+
+    bool StepComplete() {
+	bool complete = true;
+	for (int i = 0; i < layers.size()-1; i++) {
+	    complete = complete && gradients_accumulated[i] >= n_to_collect;
+	}
+	return complete;
+    }
+
+    // Apply average gradient
+    virtual void FinishStep() {
+	for (int layer = 0; layer < layers.size()-1; layer++) {
+	    layers[layer]->ApplyGrad(learning_rate / gradients_accumulated[layer],
+				     layers[layer]->GetGradient());
+	    memset(layers[layer]->GetGradient(), 0, sizeof(double) * layers[layer]->GetLayerCount());
+	}
+    }
+
+    void PrintCommunicationStats() {
+	std::cout << "Gradient bytes received: " << bytes_received
+		  << " wasted: " << bytes_wasted
+		  << " read from shared memory: " << bytes_shared
+		  << " headers rejected: " << headers_rejected << std::endl;
+	if (sums_received > 0) {
+	    std::cout << "Node sums received: " << sums_received
+		      << " carrying " << gradients_in_sums << " gradients" << std::endl;
+	}
+	std::cout << "Weight versions per layer:";
+	for (int l = 0; l < weight_versions.size(); l++) {
+	    std::cout << " " << weight_versions[l]->Size();
+	}
+	std::cout << std::endl;
+    }
+
+    // Layer l's weights as of cur_step, copied aside the first time
+    // they are asked for in the step.
+    int CurrentVersion(int l) {
+	int v = current_version[l];
+	if (v < 0 || weight_versions[l]->Step(v) != cur_step) {
+	    v = current_version[l] = weight_versions[l]->Publish(cur_step, layers[l]->GetLayer());
+	}
+	return v;
+    }
+
+    // Workers take every version sent to them, even ones they skip, so
+    // this returns once the last of them has been received.
+    void WaitWeightSends() {
+	for (int l = 0; l < weight_versions.size(); l++) {
+	    weight_versions[l]->WaitAll();
+	}
+    }
+
+    void PrintThroughput() {
+	double elapsed = GetTimeMillis() - start_training_time;
+	int n_steps = cur_step - STEP_START;
+	if (n_steps <= 0 || elapsed <= 0) {
+	    std::cout << "Master trained no steps" << std::endl;
+	    return;
+	}
+	std::cout << "Master trained " << n_steps << " steps in " << elapsed << " ms, "
+		  << elapsed / n_steps << " ms per step" << std::endl;
+	std::cout << "Master applied " << gradients_applied << " gradients, "
+		  << gradients_applied * run_config.batch_size * run_config.micro_batches * 1000 / elapsed
+		  << " samples per second" << std::endl;
+    }
 
     void SendEvaluatorSchemeName() {
 	MPI_Send((void *)name.c_str(), name.length()+1, MPI_CHAR, EVALUATOR_RANK, 0, comm);
     }
 
+    // Workers only; the evaluator gets steps with its snapshots.
     void AsynchronousBroadcastStep() {
-	for (int i = 0; i < n_procs; i++) {
-	    if (i != MASTER_RANK) {
-		MPI_Isend(&cur_step, 1, MPI_INT, i, STEP_TAG, comm, &step_broadcast_req);
-	    }
+	if (notifier) {
+	    notifier->Publish(cur_step, worker_ranks);
+	    return;
+	}
+
+	// The last step's messages are long delivered (they are one int),
+	// but their buffer is only ours again once they complete.
+	MPI_Waitall(step_broadcast_reqs.size(), step_broadcast_reqs.data(), MPI_STATUSES_IGNORE);
+	step_buffer = cur_step;
+	for (int i = 0; i < worker_ranks.size(); i++) {
+	    MPI_Isend(&step_buffer, 1, MPI_INT, worker_ranks[i], STEP_TAG, comm, &step_broadcast_reqs[worker_ranks[i]]);
 	}
     }
 
-    void AsynchronousFetchGradient(int l, int copy, MPI_Request *req) {
+    void AsynchronousFetchGradient(int l, int copy, int source, int step, MPI_Request *req) {
 	MPI_Irecv(grad_buffers[l][copy],
 		  layers[l]->GetLayerCount(),
 		  MPI_DOUBLE,
-		  MPI_ANY_SOURCE,
-		  MPI_ANY_TAG,    // Any gradient from any iteration may be fetched.
+		  source,
+		  step,
 		  layer_comms[l],
 		  req);
     }
 
+    void AsynchronousFetchGradientHeader(int l) {
+	int index = (layers.size()-1) * N_RECV_REQUESTS_PER_LAYER + l;
+	MPI_Irecv(&gradient_header_buffers[l*2],
+		  2,
+		  MPI_INT,
+		  MPI_ANY_SOURCE,
+		  GRADIENT_CONTROL_TAG,
+		  layer_comms[l],
+		  &gradient_fetch_requests[index]);
+    }
+
     void AsynchronousFetchGradientsStart() {
+	// N_RECV_REQUESTS_PER_LAYER gradient slots per layer, followed by
+	// one header request per layer and the evaluator's snapshot
+	// request. Gradient slots are only posted once their header has
+	// been accepted.
 	for (int i = 0; i < layers.size()-1; i++) {
 	    for (int k = 0; k < N_RECV_REQUESTS_PER_LAYER; k++) {
 		gradient_fetch_requests.push_back(MPI_REQUEST_NULL);
 	    }
 	}
+	for (int l = 0; l < layers.size()-1; l++) {
+	    gradient_fetch_requests.push_back(MPI_REQUEST_NULL);
+	    AsynchronousFetchGradientHeader(l);
+	}
+	gradient_fetch_requests.push_back(MPI_REQUEST_NULL);
+	AsynchronousFetchSnapshotRequest();
+    }
 
-	// We initiate a ton of requests to receive gradients for each layer.
+    MPI_Request *SnapshotRequest() {
+	return &gradient_fetch_requests[(layers.size()-1) * (N_RECV_REQUESTS_PER_LAYER+1)];
+    }
+
+    void AsynchronousFetchSnapshotRequest() {
+	MPI_Irecv(&evaluator_last_step,
+		  1,
+		  MPI_INT,
+		  EVALUATOR_RANK,
+		  SNAPSHOT_TAG,
+		  comm,
+		  SnapshotRequest());
+    }
+
+    // Returns true if index_received was a control message rather than
+    // gradient data.
+    bool HandleControlMessage(int index_received, MPI_Status &stat) {
+	int n_gradient_requests = (layers.size()-1) * N_RECV_REQUESTS_PER_LAYER;
+	if (index_received < n_gradient_requests) {
+	    return false;
+	}
+
+	// Decide whether to pull a gradient before any of its data moves.
+	int layer = index_received - n_gradient_requests;
+	if (layer < layers.size()-1) {
+	    HandleGradientHeader(layer, stat.MPI_SOURCE);
+	    AsynchronousFetchGradientHeader(layer);
+	    return true;
+	}
+
+	evaluator_snapshot_pending = true;
+	MaybeSendEvaluatorSnapshot();
+	return true;
+    }
+
+    // Send the current weights to the evaluator if it asked for them and
+    // they are newer than what it has.
+    void MaybeSendEvaluatorSnapshot() {
+	if (!evaluator_snapshot_pending || cur_step <= evaluator_last_step) {
+	    return;
+	}
+	evaluator_snapshot_pending = false;
+	SendEvaluatorSnapshot(cur_step);
+	AsynchronousFetchSnapshotRequest();
+    }
+
+    void SendEvaluatorSnapshot(int step) {
+	MPI_Request step_request;
+	snapshot_step = step;
+	MPI_Isend(&snapshot_step, 1, MPI_INT, EVALUATOR_RANK, SNAPSHOT_TAG, comm, &step_request);
+	MPI_Request_free(&step_request);
+	if (step >= run_config.n_train_iters) {
+	    return;
+	}
+	for (int l = 0; l < layers.size()-1; l++) {
+	    int v = CurrentVersion(l);
+	    MPI_Isend(weight_versions[l]->Buffer(v),
+		      layers[l]->GetLayerCount(),
+		      MPI_DOUBLE,
+		      EVALUATOR_RANK,
+		      step,
+		      layer_comms[l],
+		      &weight_versions[l]->Requests(v)[EVALUATOR_RANK]);
+	}
+    }
+
+    // Tell the evaluator training is over, in answer to its next request.
+    void FinishEvaluatorSnapshots() {
+	if (!evaluator_snapshot_pending) {
+	    MPI_Wait(SnapshotRequest(), MPI_STATUS_IGNORE);
+	}
+	SendEvaluatorSnapshot(run_config.n_train_iters);
+    }
+
+    void AsynchronousFetchGradientHeadersCancel() {
 	for (int l = 0; l < layers.size()-1; l++) {
+	    MPI_Request *req = &gradient_fetch_requests[(layers.size()-1) * N_RECV_REQUESTS_PER_LAYER + l];
+	    if (*req != MPI_REQUEST_NULL) {
+		MPI_Cancel(req);
+		MPI_Wait(req, MPI_STATUS_IGNORE);
+	    }
+	}
+    }
+
+    // Accept a gradient only if it is for the current step and the layer
+    // still needs it. Stale and surplus gradients are rejected before
+    // their data is sent, so they cost a header instead of a layer.
+    virtual bool AcceptGradient(int l, int step) {
+	return step == cur_step && gradients_accepted[l] < n_to_collect;
+    }
+
+    void HandleGradientHeader(int l, int source) {
+	int step = gradient_header_buffers[l*2];
+	int count = gradient_header_buffers[l*2+1];
+
+	// Layer 0 is the last gradient a worker offers, so its header
+	// marks when the worker (or count of them) finished the step.
+	if (tuner && l == 0) {
+	    for (int i = 0; i < count; i++) {
+		tuner->RecordArrival(step);
+	    }
+	}
+	if (count > 1 && l == 0) {
+	    sums_received++;
+	    gradients_in_sums += count;
+	}
+
+	// Co-located workers' gradients are already in shared memory, so
+	// they need no receive slot.
+	bool local = transport && transport->IsLocal(source);
+	bool accepted = AcceptGradient(l, step);
+	int slot = -1;
+	if (accepted && !local) {
 	    for (int k = 0; k < N_RECV_REQUESTS_PER_LAYER; k++) {
-		AsynchronousFetchGradient(l, k, &gradient_fetch_requests[l*N_RECV_REQUESTS_PER_LAYER+k]);
+		if (gradient_fetch_requests[l*N_RECV_REQUESTS_PER_LAYER+k] == MPI_REQUEST_NULL) {
+		    slot = k;
+		    break;
+		}
 	    }
+	    accepted = slot >= 0;
 	}
+
+	int *reply = &gradient_reply_buffers[l][source*2];
+	reply[0] = !accepted ? GRADIENT_REJECTED : local ? GRADIENT_CONSUMED : GRADIENT_ACCEPTED;
+	reply[1] = cur_step;
+
+	if (accepted && local) {
+	    if (run_config.generate_timeline) {
+		LogReceptionEvent(step, 0, source, l);
+	    }
+	    gradients_accepted[l] += count;
+	    transport->Sync();
+	    ConsumeGradient(l, step, transport->Gradient(source, l), count);
+	    bytes_shared += sizeof(double) * layers[l]->GetLayerCount();
+	}
+	else if (accepted) {
+	    gradients_accepted[l] += count;
+	    grad_buffer_counts[l][slot] = count;
+	    AsynchronousFetchGradient(l, slot, source, step,
+				      &gradient_fetch_requests[l*N_RECV_REQUESTS_PER_LAYER+slot]);
+	}
+	else {
+	    headers_rejected++;
+	}
+
+	MPI_Request reply_request;
+	MPI_Isend(reply, 2, MPI_INT, source, GRADIENT_CONTROL_TAG, layer_comms[l], &reply_request);
+	MPI_Request_free(&reply_request);
     }
 
-    void LogReceptionEvent(int step, int is_master) {
+    void LogReceptionEvent(int step, int is_master, int source = -1, int layer = -1) {
 	double time = GetTimeMillis() - start_training_time;
-	timeline_out << time << " " << step << " " << is_master << std::endl;
+	timeline_out << time << " " << step << " " << is_master << " " << n_to_collect;
+
+	// Step starts also list the weight version each layer went out in.
+	if (is_master) {
+	    for (int l = 0; l < current_version.size(); l++) {
+		timeline_out << " " << current_version[l];
+	    }
+	}
+
+	// Gradients from a worker given delays list it, its compute delay
+	// for the step and its message delay for the layer. A node sum
+	// lists its leader's.
+	else if (faults.Enabled() && source >= 0) {
+	    timeline_out << " " << source << " " << faults.ComputeDelayMillis(source, step)
+			 << " " << faults.MessageDelayMillis(source, step, layer);
+	}
+	timeline_out << std::endl;
     }
 
+    // Co-located workers read their weights from shared memory, so
+    // publishing them there costs one copy however many workers there are.
     void AsynchronousBroadcastLayerWeights() {
+	if (transport) {
+	    for (int l = 0; l < layers.size()-1; l++) {
+		transport->PublishWeights(cur_step, l, layers[l]->GetLayer());
+	    }
+	    transport->Sync();
+	}
+
 	for (int l = 0; l < layers.size()-1; l++) {
+	    int v = CurrentVersion(l);
 	    for (int i = 0; i < n_procs; i++) {
-		if (i != MASTER_RANK) {
-		    if (layer_send_requests[l][i] != MPI_REQUEST_NULL) {
-			MPI_Request_free(&layer_send_requests[l][i]);
-		    }
-
-		    MPI_Isend(layers[l]->GetLayer(),
+		if (i != MASTER_RANK && i != EVALUATOR_RANK && !(transport && transport->IsLocal(i))) {
+		    MPI_Isend(weight_versions[l]->Buffer(v),
 			      layers[l]->GetLayerCount(),
 			      MPI_DOUBLE,
 			      i,
 			      cur_step,
 			      layer_comms[l],
-			      &layer_send_requests[l][i]);
+			      &weight_versions[l]->Requests(v)[i]);
 		}
 	    }
 	}
@@ -0,0 +1,167 @@
+#ifndef _THREAD_BUDGET_
+#define _THREAD_BUDGET_
+
+#include <sched.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <fstream>
+#include <tuple>
+#include "distributed_defines.h"
+#include "../util/openblas_threads.h"
+
+// Splits the cores of a node between the ranks running on it.
+//
+// Cores are ordered by (package, physical core, cpu) so hyperthread
+// siblings and sockets stay together, then handed out to node local
+// ranks in contiguous chunks. Every compute thread of a rank (ours and
+// the BLAS pool, i.e. whatever existed before MPI_Init) is pinned to its
+// chunk and BLAS is sized to match. With reserve_progress_core the last
+// core of the node is kept out of the compute chunks and the threads
+// started by MPI_Init are pinned to it. When there are more ranks
+// than cores, ranks share cores round robin with one thread each.
+class ThreadBudget {
+ public:
+
+    // Call before MPI_Init.
+    static std::vector<pid_t> ListThreads() {
+	std::vector<pid_t> tids;
+	DIR *dir = opendir("/proc/self/task");
+	if (!dir) return tids;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+	    if (entry->d_name[0] != '.') {
+		tids.push_back(atoi(entry->d_name));
+	    }
+	}
+	closedir(dir);
+	return tids;
+    }
+
+    // CPUs this process may run on, siblings and packages adjacent.
+    static std::vector<int> OrderedCPUs() {
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	sched_getaffinity(0, sizeof(allowed), &allowed);
+	std::vector<std::tuple<int, int, int> > order;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+	    if (CPU_ISSET(cpu, &allowed)) {
+		order.push_back(std::make_tuple(ReadTopologyId(cpu, "physical_package_id"),
+						ReadTopologyId(cpu, "core_id"),
+						cpu));
+	    }
+	}
+	std::sort(order.begin(), order.end());
+	std::vector<int> cpus;
+	for (int i = 0; i < order.size(); i++) {
+	    cpus.push_back(std::get<2>(order[i]));
+	}
+	return cpus;
+    }
+
+    ThreadBudget(MPI_Comm comm, std::vector<pid_t> &compute_threads, bool reserve_progress_core) {
+	this->compute_threads = compute_threads;
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node_comm);
+	MPI_Comm_rank(node_comm, &local_rank);
+	MPI_Comm_size(node_comm, &local_size);
+
+	std::vector<int> cpus = OrderedCPUs();
+	n_node_cpus = cpus.size();
+	progress_cpu = -1;
+	if (reserve_progress_core && n_node_cpus > local_size) {
+	    progress_cpu = cpus.back();
+	    cpus.pop_back();
+	}
+
+	if (local_size >= cpus.size()) {
+	    rank_cpus.push_back(cpus[local_rank % cpus.size()]);
+	}
+	else {
+	    int per_rank = cpus.size() / local_size;
+	    int extra = cpus.size() % local_size;
+	    int first = local_rank * per_rank + std::min(local_rank, extra);
+	    int count = per_rank + (local_rank < extra ? 1 : 0);
+	    rank_cpus.assign(cpus.begin() + first, cpus.begin() + first + count);
+	}
+    }
+
+    ~ThreadBudget() {
+	MPI_Comm_free(&node_comm);
+    }
+
+    // Number of threads a rank's compute should use.
+    int ComputeThreads() {
+	return rank_cpus.size();
+    }
+
+    std::vector<int> ComputeCPUs() {
+	return rank_cpus;
+    }
+
+    void Apply() {
+	cpu_set_t compute_set;
+	CPU_ZERO(&compute_set);
+	for (int i = 0; i < rank_cpus.size(); i++) {
+	    CPU_SET(rank_cpus[i], &compute_set);
+	}
+
+	std::vector<pid_t> threads = ListThreads();
+	n_mpi_threads = 0;
+	for (int i = 0; i < threads.size(); i++) {
+	    bool is_compute = std::find(compute_threads.begin(), compute_threads.end(), threads[i]) != compute_threads.end();
+	    if (is_compute) {
+		sched_setaffinity(threads[i], sizeof(compute_set), &compute_set);
+	    }
+	    else {
+		n_mpi_threads++;
+		if (progress_cpu >= 0) {
+		    cpu_set_t progress_set;
+		    CPU_ZERO(&progress_set);
+		    CPU_SET(progress_cpu, &progress_set);
+		    sched_setaffinity(threads[i], sizeof(progress_set), &progress_set);
+		}
+	    }
+	}
+
+	if (openblas_set_num_threads) {
+	    openblas_set_num_threads(ComputeThreads());
+	}
+    }
+
+    // Node local rank 0 prints the layout of its node.
+    void PrintLayout() {
+	char hostname[1024];
+	gethostname(hostname, 1024);
+	int mine[4] = {rank, rank_cpus.front(), (int)rank_cpus.size(), n_mpi_threads};
+	std::vector<int> all(4 * local_size);
+	MPI_Gather(mine, 4, MPI_INT, all.data(), 4, MPI_INT, 0, node_comm);
+	if (local_rank != 0) return;
+
+	std::cout << "Thread budget on " << hostname << ": " << n_node_cpus << " cpus, "
+		  << local_size << " ranks, BLAS threads "
+		  << (openblas_set_num_threads ? "managed" : "unmanaged (set OPENBLAS_NUM_THREADS)");
+	if (progress_cpu >= 0) {
+	    std::cout << ", MPI threads on cpu " << progress_cpu;
+	}
+	std::cout << std::endl;
+	for (int i = 0; i < local_size; i++) {
+	    std::cout << "  rank " << all[i*4] << ": " << all[i*4+2] << " cpu(s) starting at cpu " << all[i*4+1]
+		      << ", " << all[i*4+3] << " MPI thread(s)" << std::endl;
+	}
+    }
+
+ protected:
+    int rank, local_rank, local_size, n_node_cpus, progress_cpu, n_mpi_threads;
+    MPI_Comm node_comm;
+    std::vector<pid_t> compute_threads;
+    std::vector<int> rank_cpus;
+
+    static int ReadTopologyId(int cpu, string name) {
+	ifstream file("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/" + name);
+	int id = 0;
+	if (file.is_open()) file >> id;
+	return id;
+    }
+};
+
+#endif
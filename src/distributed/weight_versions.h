@@ -0,0 +1,97 @@
+#ifndef _WEIGHT_VERSIONS_
+#define _WEIGHT_VERSIONS_
+
+#include "distributed_defines.h"
+
+// Buffers holding successive versions (steps) of one layer's weights,
+// so that one version can be on the wire while another is computed with
+// or updated. Each version carries the requests moving it; a buffer is
+// handed out again only once all of them have completed. If every
+// version is still in flight another one is allocated, so a peer that
+// is slow to take its copy costs memory rather than a stall.
+class WeightVersions {
+ public:
+    // If given, adopted is used as the first version and left to its
+    // owner to free.
+    WeightVersions(size_t count, int n_requests, double *adopted = NULL) {
+	this->count = count;
+	this->n_requests = n_requests;
+	this->adopted = adopted;
+	if (adopted) {
+	    Add(adopted);
+	}
+    }
+
+    ~WeightVersions() {
+	for (int v = 0; v < buffers.size(); v++) {
+	    if (buffers[v] != adopted) free(buffers[v]);
+	}
+    }
+
+    // Make sure there are at least n versions.
+    void Reserve(int n) {
+	while (buffers.size() < n) {
+	    double *buffer;
+	    AllocateMemory(&buffer, count);
+	    Add(buffer);
+	}
+    }
+
+    // A version with nothing in flight, other than exclude.
+    int Free(int exclude = -1) {
+	for (int v = 0; v < buffers.size(); v++) {
+	    if (v == exclude) continue;
+	    int completed = 0;
+	    MPI_Testall(n_requests, requests[v].data(), &completed, MPI_STATUSES_IGNORE);
+	    if (completed) return v;
+	}
+	Reserve(buffers.size()+1);
+	return buffers.size()-1;
+    }
+
+    // Copy weights for step into a free version.
+    int Publish(int step, double *weights) {
+	int v = Free();
+	memcpy(buffers[v], weights, sizeof(double) * count);
+	steps[v] = step;
+	return v;
+    }
+
+    void WaitAll() {
+	for (int v = 0; v < buffers.size(); v++) {
+	    MPI_Waitall(n_requests, requests[v].data(), MPI_STATUSES_IGNORE);
+	}
+    }
+
+    double *Buffer(int v) {
+	return buffers[v];
+    }
+
+    int &Step(int v) {
+	return steps[v];
+    }
+
+    MPI_Request *Requests(int v) {
+	return requests[v].data();
+    }
+
+    int Size() {
+	return buffers.size();
+    }
+
+ protected:
+    size_t count;
+    int n_requests;
+    double *adopted;
+    std::vector<double *> buffers;
+    std::vector<int> steps;
+    std::vector<std::vector<MPI_Request> > requests;
+
+    void Add(double *buffer) {
+	buffers.push_back(buffer);
+	steps.push_back(STEP_UNINITIALIZED);
+	requests.push_back(std::vector<MPI_Request>(n_requests, MPI_REQUEST_NULL));
+    }
+};
+
+#endif
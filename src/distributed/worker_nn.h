@@ -2,6 +2,12 @@
 #define _WORKER_NN_
 
 #include "distributed_defines.h"
+#include "shared_memory_transport.h"
+#include "step_notifier.h"
+#include "weight_versions.h"
+#include "node_aggregator.h"
+#include "fault_injector.h"
+#include "step_trace.h"
 
 struct LayerSendRequest {
     MPI_Request request;
@@ -12,19 +18,88 @@ typedef struct LayerSendRequest LayerSendRequest;
 
 class WorkerNN : public NN {
  public:
-   WorkerNN(NNParams *params, std::vector<MPI_Comm> &layer_comms, int rank, int n_procs) : NN(params), layer_comms(layer_comms) {
+   WorkerNN(NNParams *params, std::vector<MPI_Comm> &layer_comms, int rank, int n_procs, int staleness = 0) : NN(params), layer_comms(layer_comms), faults(n_procs), trace(rank, "worker", layers) {
 	this->rank = rank;
 	this->n_procs = n_procs;
+	this->staleness = staleness;
 	this->cur_step = STEP_UNINITIALIZED;
 	this->comm = MPI_COMM_WORLD;
 	this->next_step = STEP_UNINITIALIZED;
 	this->step_fetch_request = MPI_REQUEST_NULL;
-
+	this->master_step_hint = STEP_UNINITIALIZED;
+	this->bytes_sent = this->bytes_suppressed = this->bytes_shared = this->bytes_to_leader = 0;
+	this->transport = NULL;
+	this->notifier = NULL;
+	this->aggregator = NULL;
+	this->zero_copy_weights = true;
+	this->idle = this->batch_prefetched = false;
+	this->idle_backoff_us = 1;
+	this->idle_wall_millis = this->idle_cpu_millis = 0;
+	this->last_idle_millis = 0;
+	this->n_steps_trained = 0;
+	this->n_stale_weight_steps = this->n_mixed_weight_steps = 0;
+	this->injected_compute_millis = this->injected_message_millis = 0;
 
 	for (int i = 0; i < layers.size(); i++) {
 	    layer_cur_step.push_back(STEP_UNINITIALIZED);
-	    layer_fetch_requests.push_back(MPI_REQUEST_NULL);
 	    layer_send_requests.push_back(MPI_REQUEST_NULL);
+	    gradient_header_requests.push_back(MPI_REQUEST_NULL);
+	    gradient_reply_requests.push_back(MPI_REQUEST_NULL);
+	    gradient_header_buffers.push_back(STEP_UNINITIALIZED);
+	    gradient_header_buffers.push_back(1);
+	    offered_gradients.push_back(NULL);
+	    gradient_reply_buffers.push_back(GRADIENT_REJECTED);
+	    gradient_reply_buffers.push_back(STEP_UNINITIALIZED);
+	    offer_due.push_back(-1);
+	    offer_step.push_back(STEP_UNINITIALIZED);
+	}
+
+	// The layer's own buffer is the first version; a second is only
+	// allocated once weights arrive by message.
+	weights_step = STEP_UNINITIALIZED;
+	for (int i = 0; i < layers.size()-1; i++) {
+	    own_weights.push_back(layers[i]->weights);
+	    weight_versions.push_back(new WeightVersions(layers[i]->GetLayerCount(), 1, layers[i]->weights));
+	    front_version.push_back(0);
+	    fetch_version.push_back(-1);
+	    received_step.push_back(STEP_UNINITIALIZED);
+	}
+    }
+
+    ~WorkerNN() {
+	// Give the layers their own buffers back before they free them.
+	for (int i = 0; i < own_weights.size(); i++) {
+	    layers[i]->weights = own_weights[i];
+	    delete weight_versions[i];
+	}
+	for (int i = 0; i < own_grads.size(); i++) {
+	    layers[i]->grad = own_grads[i];
+	}
+    }
+
+    // Read weights from and write gradients to shared memory, if we are
+    // on the master's node. Gradients are computed straight into our
+    // slot; weights are used in place unless zero_copy_weights is off.
+    void UseSharedMemory(SharedMemoryTransport *transport) {
+	if (!transport->IsLocal(rank)) return;
+	this->transport = transport;
+	for (int i = 0; i < layers.size()-1; i++) {
+	    own_grads.push_back(layers[i]->grad);
+	    layers[i]->grad = transport->Gradient(rank, i);
+	}
+    }
+
+    // Learn about new steps from a counter the master writes into our
+    // memory rather than from STEP_TAG messages.
+    void UseStepNotifier(StepNotifier *notifier) {
+	this->notifier = notifier;
+    }
+
+    // Sum gradients with the other workers of our node before they go to
+    // the master, if there are any.
+    void UseNodeAggregator(NodeAggregator *aggregator) {
+	if (aggregator->Enabled()) {
+	    this->aggregator = aggregator;
 	}
     }
 
@@ -43,83 +118,141 @@ class WorkerNN : public NN {
 	while (true) {
 
 	    AsynchronousFetchStepUpdate();
+	    ProgressGradientSends();
 	    bool updated = UpdateStep();
-	    if (!updated && !first) continue;
+
+	    // With a staleness bound the worker keeps computing on the
+	    // weights it has instead of waiting for the next step.
+	    if (!updated && !first && staleness == 0) {
+		Idle(data, labels, n_examples);
+		continue;
+	    }
+	    EndIdle();
 	    first = false;
+	    n_steps_trained++;
 	    std::cout << rank << " " <<cur_step << std::endl;
 	    AsynchronousFetchWeights();
-	    FillNextBatch(data, labels, n_examples);
 
-	    if (cur_step >= N_TRAIN_ITERS) break;
+	    if (cur_step >= run_config.n_train_iters) break;
 
-	    // Forward propagate
-	    for (int i = 0; i < layers.size(); i++) {
+	    // Gradients of all micro-batches are summed in the layers'
+	    // gradient buffers and offered once, after the last one.
+	    bool short_circuited = InjectComputeDelay();
+	    weights_step = cur_step;
+	    for (int m = 0; m < n_micro_batches && !short_circuited; m++) {
+		bool first_micro_batch = m == 0, last_micro_batch = m == n_micro_batches-1;
 
-		// Handle short circuiting.
-#if SHORTCIRCUIT
-		if (StepChanged()) {
-		    std::cout << "SHORTCIRCUIT" << std::endl;
-		    break;
-	        }
-#endif
-
-		// Wait for the synced weight layer to be fetched
-		if (i != layers.size()-1) {
-		    MPI_Wait(&layer_fetch_requests[i], MPI_STATUS_IGNORE);
-		    layer_cur_step[i] = cur_step;
+		// The first batch may already have been prepared while idle.
+		if (!first_micro_batch || !batch_prefetched) {
+		    FillNextBatch(data, labels, n_examples);
 		}
+		batch_prefetched = false;
 
-		// Do forward propagation
-		layers[i]->ForwardPropagateCore(batch_data_placeholder);
-	    }
+		// Forward propagate
+		for (int i = 0; i < layers.size(); i++) {
+
+		    // Handle short circuiting.
+		    if (run_config.shortcircuit && StepChanged()) {
+			std::cout << "SHORTCIRCUIT" << std::endl;
+			short_circuited = true;
+			break;
+		    }
 
-	    // Back propagate
-	    for (int i = layers.size()-1; i >= 0; i--) {
+		    // Wait for the synced weight layer to be fetched
+		    if (i != layers.size()-1) {
+			WaitLayerWeights(i);
+		    }
 
-#if SHORTCIRCUIT
-		if (StepChanged()) {
-		  std::cout << "SHORTCIRCUIT" << std::endl;
-		    break;
+		    // Do forward propagation
+		    double start = StepTrace::Now();
+		    layers[i]->ForwardPropagateCore(batch_data_placeholder);
+		    trace.Forward(i, start);
 		}
-#endif
+		if (short_circuited) break;
+
+		// Back propagate
+		for (int i = layers.size()-1; i >= 0; i--) {
 
-		// Check that the previous gradient has been sent
-		if (i != layers.size()-1) {
-		    if (layer_send_requests[i] != MPI_REQUEST_NULL) {
-			MPI_Wait(&layer_send_requests[i], MPI_STATUS_IGNORE);
+		    if (run_config.shortcircuit && StepChanged()) {
+			std::cout << "SHORTCIRCUIT" << std::endl;
+			short_circuited = true;
+			break;
 		    }
-		}
 
-		// Backpropagate core.
-		layers[i]->BackPropagateCore(batch_labels_placeholder);
+		    // Check that the previous gradient has been sent before
+		    // overwriting it.
+		    if (first_micro_batch && i != layers.size()-1) {
+			ResolveGradientSend(i);
+			if (layer_send_requests[i] != MPI_REQUEST_NULL) {
+			    MPI_Wait(&layer_send_requests[i], MPI_STATUS_IGNORE);
+			}
+		    }
 
-		// Send the layer's gradient.
-		if (i != layers.size()-1) {
+		    // Backpropagate core.
+		    double start = StepTrace::Now();
+		    layers[i]->BackPropagateCore(batch_labels_placeholder, !first_micro_batch);
+		    trace.Backward(i, start);
 
-		    // Do a buffered send to avoid having to wait for recv on the other end.
-		    MPI_Isend(layers[i]->GetGradient(),
-			      layers[i]->GetLayerCount(),
-			      MPI_DOUBLE,
-			      MASTER_RANK,
-			      cur_step,
-			      layer_comms[i],
-			      &layer_send_requests[i]);
+		    // Offer the layer's gradient to the master.
+		    if (last_micro_batch && i != layers.size()-1) {
+			AsynchronousSendGradientHeader(i);
+		    }
+		    ProgressGradientSends();
 		}
 	    }
+	    if (!short_circuited) {
+		CountWeightSteps();
+		trace.EndCompute(cur_step);
+	    }
+	    else {
+		trace.Clear();
+	    }
+	}
+
+	DrainWeightFetches();
+	FinishAggregation();
+	AbandonGradientSends();
+	CancelStepFetch();
+	std::cout << "Worker " << rank << " gradient bytes sent: " << bytes_sent
+		  << " suppressed: " << bytes_suppressed
+		  << " shared: " << bytes_shared
+		  << " to node leader: " << bytes_to_leader << std::endl;
+	if (aggregator) {
+	    aggregator->Print(rank);
 	}
+	PrintInjectedDelays();
+	PrintStepStats();
     }
 
  protected:
 
     // The synchronized step (should be the same across workers & master)
     int cur_step, rank, n_procs, next_step;
+
+    // How many steps behind the master our weights may be before a
+    // gradient is no longer worth sending. 0 is fully synchronous.
+    int staleness;
     MPI_Comm comm;
 
     // layer_cur_step[i] is the iteration step for the current weights
     std::vector<int> layer_cur_step;
 
-    // Requests for fetching each layer.
-    std::vector<MPI_Request> layer_fetch_requests;
+    // Weights by message arrive in a version other than front_version,
+    // the one the layer computes with. fetch_version[i] is the version
+    // receiving layer i (-1 if none) and received_step[i] the last step
+    // received. Every step the master sends is received, even one we
+    // skip, so its copy can be reused.
+    std::vector<WeightVersions *> weight_versions;
+    std::vector<int> front_version, fetch_version, received_step;
+
+    // The oldest weights the current step's passes used, which is the
+    // step its gradients are offered for.
+    int weights_step;
+
+    // Finished steps computed on weights older than the step, and on
+    // layers whose weights were of different steps.
+    int n_stale_weight_steps, n_mixed_weight_steps;
+
     std::vector<MPI_Request> layer_send_requests;
 
     // Layer communicator handles
@@ -128,8 +261,373 @@ class WorkerNN : public NN {
     // Requests for fetching the step.
     MPI_Request step_fetch_request;
 
+    // Gradient control channel state. gradient_header_buffers[i*2] holds
+    // the step of the gradient offered for layer i and [i*2+1] the number
+    // of gradients summed in it, offered_gradients[i] the gradient. They
+    // are only valid while gradient_reply_requests[i] is pending.
+    std::vector<MPI_Request> gradient_header_requests;
+    std::vector<MPI_Request> gradient_reply_requests;
+    std::vector<int> gradient_header_buffers;
+    std::vector<int> gradient_reply_buffers;
+    std::vector<double *> offered_gradients;
+
+    // Latest step the master reported in a gradient reply.
+    int master_step_hint;
+    long long int bytes_sent, bytes_suppressed, bytes_shared, bytes_to_leader;
+
+    // Node local fast path, NULL when not on the master's node.
+    SharedMemoryTransport *transport;
+
+    // Step counter, NULL to receive steps as messages.
+    StepNotifier *notifier;
+
+    // Our node's gradient sums, NULL if we offer our own to the master.
+    NodeAggregator *aggregator;
+
+    // Injected delays. offer_due[i] is when layer i's gradient for
+    // offer_step[i] is to be offered, -1 if none is held back.
+    FaultInjector faults;
+    std::vector<double> offer_due;
+    std::vector<int> offer_step;
+    double injected_compute_millis, injected_message_millis;
+
+    // Compute times per step, for simulator_nn.
+    StepTrace trace;
+    bool zero_copy_weights;
+    std::vector<double *> own_weights, own_grads;
+
+    // Idle period bookkeeping. Idle time is spent between finishing a
+    // step and the master announcing the next one.
+    bool idle, batch_prefetched;
+    int idle_backoff_us, n_steps_trained;
+    double idle_start_wall, idle_start_cpu;
+    double idle_wall_millis, idle_cpu_millis, last_idle_millis;
+
+    // Called while waiting for the next step. The first call prepares
+    // the next batch; after that we give the core back according to
+    // WORKER_IDLE_POLICY.
+    void Idle(uchar **data, uchar *labels, int n_examples) {
+	if (!idle) {
+	    idle = true;
+	    idle_backoff_us = 1;
+	    idle_start_wall = GetTimeMillis();
+	    idle_start_cpu = GetThreadCPUTimeMillis();
+	}
+
+	if (!batch_prefetched) {
+	    FillNextBatch(data, labels, n_examples);
+	    batch_prefetched = true;
+
+	    // Prefetching is useful work, don't count it as wasted.
+	    idle_start_cpu = GetThreadCPUTimeMillis();
+	    return;
+	}
+
+#if WORKER_IDLE_POLICY == IDLE_BACKOFF
+	usleep(idle_backoff_us);
+	idle_backoff_us = std::min(idle_backoff_us * 2, IDLE_BACKOFF_MAX_US);
+#elif WORKER_IDLE_POLICY == IDLE_BLOCK
+	// A node leader has its members' gradients to take as well, and
+	// offers held back have to go out on time, so then we sleep rather
+	// than block.
+	if ((aggregator && aggregator->IsLeader()) || OffersHeldBack()) {
+	    usleep(IDLE_BACKOFF_MAX_US);
+	}
+	else {
+	    WaitStepOrGradientReply();
+	}
+#endif
+    }
+
+    void CountWeightSteps() {
+	n_stale_weight_steps += weights_step < cur_step;
+	for (int i = 1; i < layers.size()-1; i++) {
+	    if (layer_cur_step[i] != layer_cur_step[0]) {
+		n_mixed_weight_steps++;
+		break;
+	    }
+	}
+    }
+
+    void EndIdle() {
+	if (!idle) return;
+	idle = false;
+	last_idle_millis = GetTimeMillis() - idle_start_wall;
+	idle_wall_millis += last_idle_millis;
+	idle_cpu_millis += GetThreadCPUTimeMillis() - idle_start_cpu;
+    }
+
+    // Block until either the next step arrives or one of our gradient
+    // headers is answered. The latter has to be serviced, since the
+    // master may be waiting on that gradient to finish the step.
+    //
+    // A step counter can't be waited on, so with one we only block while
+    // a reply is outstanding and otherwise sleep as IDLE_BACKOFF does.
+    void WaitStepOrGradientReply() {
+	std::vector<MPI_Request> requests(gradient_reply_requests.begin(),
+					  gradient_reply_requests.end()-1);
+	if (notifier) {
+	    int index = -1;
+	    MPI_Waitany(requests.size(), requests.data(), &index, MPI_STATUS_IGNORE);
+	    if (index == MPI_UNDEFINED) {
+		usleep(IDLE_BACKOFF_MAX_US);
+		return;
+	    }
+	    gradient_reply_requests[index] = requests[index];
+	    CompleteGradientSend(index);
+	    return;
+	}
+	requests.push_back(step_fetch_request);
+	int index = -1;
+	MPI_Waitany(requests.size(), requests.data(), &index, MPI_STATUS_IGNORE);
+	if (index == MPI_UNDEFINED) return;
+	if (index == requests.size()-1) {
+	    step_fetch_request = requests[index];
+	}
+	else {
+	    gradient_reply_requests[index] = requests[index];
+	    CompleteGradientSend(index);
+	}
+    }
+
     bool StepChanged() {
-	return NewStepQueued() || cur_step != next_step;
+	if (staleness == 0) {
+	    return master_step_hint > cur_step || NewStepQueued() || cur_step != next_step;
+	}
+	AsynchronousFetchStepUpdate();
+	return std::max(master_step_hint, next_step) - cur_step > staleness;
+    }
+
+    // Offer layer i's gradient for the weights' step. Skip it outright
+    // if we already know the step has moved on, or hold it back for an
+    // injected message delay.
+    void AsynchronousSendGradientHeader(int i) {
+	if (StepChanged()) {
+	    bytes_suppressed += sizeof(double) * layers[i]->GetLayerCount();
+	    return;
+	}
+	double delay = faults.MessageDelayMillis(rank, weights_step, i);
+	if (delay > 0) {
+	    injected_message_millis += delay;
+	    offer_due[i] = GetTimeMillis() + delay;
+	    offer_step[i] = weights_step;
+	    return;
+	}
+	OfferGradient(i, weights_step);
+    }
+
+    // With a node aggregator the gradient goes to the node's sum instead
+    // of the master.
+    void OfferGradient(int i, int step) {
+	if (aggregator && aggregator->IsLeader()) {
+	    aggregator->Add(i, step, layers[i]->GetGradient());
+	    FlushAggregates();
+	    return;
+	}
+	if (aggregator) {
+	    bytes_to_leader += sizeof(double) * layers[i]->GetLayerCount();
+	    aggregator->Contribute(i, step, layers[i]->GetGradient(), &layer_send_requests[i]);
+	    return;
+	}
+	SendGradientHeader(i, step, 1, layers[i]->GetGradient());
+    }
+
+    // Offers held back are made once due, even if the step has moved on
+    // meanwhile: a late message still arrives, only to be rejected.
+    void SendDueOffers() {
+	for (int i = 0; i < offer_due.size(); i++) {
+	    if (offer_due[i] >= 0 && GetTimeMillis() >= offer_due[i]) {
+		offer_due[i] = -1;
+		OfferGradient(i, offer_step[i]);
+	    }
+	}
+    }
+
+    bool OffersHeldBack() {
+	for (int i = 0; i < offer_due.size(); i++) {
+	    if (offer_due[i] >= 0) return true;
+	}
+	return false;
+    }
+
+    // Stand in for a slow step. Offers and replies keep moving while we
+    // wait, and with short circuiting a new step cuts the wait short as
+    // it would the computation. Returns whether it did.
+    bool InjectComputeDelay() {
+	double delay = faults.ComputeDelayMillis(rank, cur_step);
+	if (delay <= 0) return false;
+	double start = GetTimeMillis(), end = start + delay;
+	bool short_circuited = false;
+	double now;
+	while ((now = GetTimeMillis()) < end) {
+	    if (run_config.shortcircuit && StepChanged()) {
+		std::cout << "SHORTCIRCUIT" << std::endl;
+		short_circuited = true;
+		break;
+	    }
+	    usleep(std::min(1000.0, (end - now) * 1000));
+	    ProgressGradientSends();
+	}
+	injected_compute_millis += GetTimeMillis() - start;
+	trace.Delay(GetTimeMillis() - start);
+	return short_circuited;
+    }
+
+    void PrintStepStats() {
+	std::cout << "Worker " << rank << " steps on older weights: " << n_stale_weight_steps
+		  << ", on weights of mixed steps: " << n_mixed_weight_steps << std::endl;
+	std::cout << "Worker " << rank << " idle: " << idle_wall_millis << " ms wall, "
+		  << idle_cpu_millis << " ms cpu, "
+		  << idle_cpu_millis / std::max(n_steps_trained, 1) << " core-ms wasted per step" << std::endl;
+    }
+
+    void PrintInjectedDelays() {
+	if (!faults.Enabled()) return;
+	std::cout << "Worker " << rank << " injected delays: " << injected_compute_millis << " ms compute, "
+		  << injected_message_millis << " ms message" << std::endl;
+    }
+
+    // Offer the master count gradients of layer i for step, summed in
+    // gradient.
+    void SendGradientHeader(int i, int step, int count, double *gradient) {
+	gradient_header_buffers[i*2] = step;
+	gradient_header_buffers[i*2+1] = count;
+	offered_gradients[i] = gradient;
+	if (transport) {
+	    transport->Sync();
+	}
+	MPI_Isend(&gradient_header_buffers[i*2],
+		  2,
+		  MPI_INT,
+		  MASTER_RANK,
+		  GRADIENT_CONTROL_TAG,
+		  layer_comms[i],
+		  &gradient_header_requests[i]);
+	MPI_Irecv(&gradient_reply_buffers[i*2],
+		  2,
+		  MPI_INT,
+		  MASTER_RANK,
+		  GRADIENT_CONTROL_TAG,
+		  layer_comms[i],
+		  &gradient_reply_requests[i]);
+    }
+
+    // Send the gradient data once the master accepted the header.
+    void CompleteGradientSend(int i) {
+	MPI_Wait(&gradient_header_requests[i], MPI_STATUS_IGNORE);
+	int accepted = gradient_reply_buffers[i*2];
+	master_step_hint = std::max(master_step_hint, gradient_reply_buffers[i*2+1]);
+	if (accepted == GRADIENT_ACCEPTED) {
+	    bytes_sent += sizeof(double) * layers[i]->GetLayerCount();
+	    MPI_Isend(offered_gradients[i],
+		      layers[i]->GetLayerCount(),
+		      MPI_DOUBLE,
+		      MASTER_RANK,
+		      gradient_header_buffers[i*2],
+		      layer_comms[i],
+		      &layer_send_requests[i]);
+	}
+	else if (accepted == GRADIENT_CONSUMED) {
+	    bytes_shared += sizeof(double) * layers[i]->GetLayerCount();
+	}
+	else {
+	    bytes_suppressed += sizeof(double) * layers[i]->GetLayerCount();
+	}
+    }
+
+    void ProgressGradientSends() {
+	SendDueOffers();
+	for (int i = 0; i < layers.size()-1; i++) {
+	    if (gradient_reply_requests[i] == MPI_REQUEST_NULL) continue;
+	    int completed = 0;
+	    MPI_Test(&gradient_reply_requests[i], &completed, MPI_STATUS_IGNORE);
+	    if (completed) {
+		CompleteGradientSend(i);
+	    }
+	}
+	if (aggregator && aggregator->IsLeader()) {
+	    aggregator->Progress();
+	    FlushAggregates();
+	}
+    }
+
+    // Offer each layer's node sum that is due, once the layer's last
+    // offer has been answered and its data sent.
+    void FlushAggregates() {
+	for (int i = 0; i < layers.size()-1; i++) {
+	    if (gradient_reply_requests[i] != MPI_REQUEST_NULL) continue;
+	    int sent = 0;
+	    MPI_Test(&layer_send_requests[i], &sent, MPI_STATUS_IGNORE);
+	    if (!sent) continue;
+	    int step, count;
+	    double *sum;
+	    if (aggregator->Flush(i, &step, &count, &sum)) {
+		SendGradientHeader(i, step, count, sum);
+	    }
+	}
+    }
+
+    // Our last gradients are on their way to the leader, or, for the
+    // leader, every member's has been taken. Sums still open are dropped.
+    void FinishAggregation() {
+	if (!aggregator) return;
+	aggregator->Finish();
+	if (!aggregator->IsLeader()) {
+	    MPI_Waitall(layer_send_requests.size(), layer_send_requests.data(), MPI_STATUSES_IGNORE);
+	}
+    }
+
+    // Layer i's gradient buffer is about to be overwritten, so its
+    // offer must be made and answered first. The master stops answering
+    // once training is done, so give up when the final step shows up.
+    void ResolveGradientSend(int i) {
+	while (offer_due[i] >= 0 || gradient_reply_requests[i] != MPI_REQUEST_NULL) {
+	    SendDueOffers();
+	    int completed = 0;
+	    if (gradient_reply_requests[i] != MPI_REQUEST_NULL) {
+		MPI_Test(&gradient_reply_requests[i], &completed, MPI_STATUS_IGNORE);
+	    }
+	    if (completed) {
+		CompleteGradientSend(i);
+		return;
+	    }
+	    if (aggregator && aggregator->IsLeader()) {
+		aggregator->Progress();
+	    }
+	    AsynchronousFetchStepUpdate();
+	    if (next_step >= run_config.n_train_iters) {
+		AbandonGradientSends();
+		return;
+	    }
+	}
+    }
+
+    void AbandonGradientSends() {
+	for (int i = 0; i < layers.size()-1; i++) {
+	    if (offer_due[i] >= 0) {
+		offer_due[i] = -1;
+		bytes_suppressed += sizeof(double) * layers[i]->GetLayerCount();
+	    }
+	    if (gradient_reply_requests[i] != MPI_REQUEST_NULL) {
+		MPI_Status status;
+		int cancelled = 0;
+		MPI_Cancel(&gradient_reply_requests[i]);
+		MPI_Wait(&gradient_reply_requests[i], &status);
+		MPI_Test_cancelled(&status, &cancelled);
+		if (cancelled) {
+		    bytes_suppressed += sizeof(double) * layers[i]->GetLayerCount();
+		}
+		else {
+		    CompleteGradientSend(i);
+		}
+	    }
+	    if (gradient_header_requests[i] != MPI_REQUEST_NULL) {
+		MPI_Request_free(&gradient_header_requests[i]);
+	    }
+	}
+
+	// The master waits for the gradients it accepted.
+	MPI_Waitall(layer_send_requests.size(), layer_send_requests.data(), MPI_STATUSES_IGNORE);
     }
 
     // Returns whether fetched new step was different from cur step.
@@ -140,12 +638,19 @@ class WorkerNN : public NN {
     }
 
     int NewStepQueued() {
+	if (notifier) {
+	    return notifier->Latest() > next_step;
+	}
 	int found_step = 0;
 	MPI_Iprobe(0, STEP_TAG, this->comm, &found_step, MPI_STATUS_IGNORE);
 	return found_step;
     }
 
     void AsynchronousFetchStepUpdate() {
+	if (notifier) {
+	    next_step = std::max(next_step, notifier->Poll());
+	    return;
+	}
 	int completed_step_fetch = 0;
 	if (step_fetch_request == MPI_REQUEST_NULL)
 	    completed_step_fetch = 1;
@@ -176,6 +681,12 @@ class WorkerNN : public NN {
     }
 
     void SynchronousFetchStep() {
+	if (notifier) {
+	    while ((next_step = notifier->Poll()) == STEP_UNINITIALIZED) {
+		usleep(IDLE_BACKOFF_MAX_US);
+	    }
+	    return;
+	}
 	MPI_Recv(&next_step,
 		 1,
 		 MPI_INT,
@@ -185,28 +696,99 @@ class WorkerNN : public NN {
 		 MPI_STATUS_IGNORE);
     }
 
+    // The master sends one last step after we leave, or none, so the
+    // receive posted for it is cancelled rather than left behind.
+    void CancelStepFetch() {
+	if (step_fetch_request != MPI_REQUEST_NULL) {
+	    MPI_Cancel(&step_fetch_request);
+	    MPI_Wait(&step_fetch_request, MPI_STATUS_IGNORE);
+	}
+    }
+
+    // Wait for layer i's weights for cur_step. From shared memory they
+    // are ready once the step has arrived. By message, within the
+    // staleness bound the weights we have will do while newer ones
+    // arrive.
+    void WaitLayerWeights(int i) {
+	if (transport) {
+	    if (layer_cur_step[i] < cur_step) {
+		transport->Sync();
+		if (zero_copy_weights) {
+		    layers[i]->weights = transport->Weights(cur_step, i);
+		}
+		else {
+		    memcpy(layers[i]->weights, transport->Weights(cur_step, i),
+			   sizeof(double) * layers[i]->GetLayerCount());
+		}
+	    }
+	    layer_cur_step[i] = cur_step;
+	}
+	else {
+	    ProgressWeightFetch(i, std::max(cur_step - staleness, STEP_START));
+	}
+	weights_step = std::min(weights_step, layer_cur_step[i]);
+    }
+
     // Fetch all layer weights asynchronously. (from master).
+    // Co-located workers skip this and read shared memory instead.
     void AsynchronousFetchWeights() {
+	if (transport) return;
 
 	// Last layer has no weights.
 	for (int i = 0; i < layers.size()-1; i++) {
-	    // Check if we have already fetched the weights for this
-	    // particular step. If so, don't fetch it.
-	    if (layer_cur_step[i] < cur_step) {
+	    ProgressWeightFetch(i, STEP_UNINITIALIZED);
+	}
+    }
 
-		// Be sure to free the layer fetch requests
-		if (layer_fetch_requests[i] != MPI_REQUEST_NULL) {
-		    MPI_Request_free(&layer_fetch_requests[i]);
-		}
+    // Receive the step after the last one received, up to cur_step, into
+    // a version we are not computing with. No weights are sent for the
+    // final step.
+    void PostWeightFetch(int i) {
+	int last_step = std::min(cur_step, run_config.n_train_iters-1);
+	if (fetch_version[i] >= 0 || received_step[i] >= last_step) {
+	    return;
+	}
+	int v = weight_versions[i]->Free(front_version[i]);
+	weight_versions[i]->Step(v) = received_step[i]+1;
+	fetch_version[i] = v;
+	MPI_Irecv(weight_versions[i]->Buffer(v),
+		  layers[i]->GetLayerCount(),
+		  MPI_DOUBLE,
+		  MASTER_RANK,
+		  weight_versions[i]->Step(v),
+		  layer_comms[i],
+		  weight_versions[i]->Requests(v));
+    }
 
-		MPI_Irecv(layers[i]->GetLayer(),
-			  layers[i]->GetLayerCount(),
-			  MPI_DOUBLE,
-			  MASTER_RANK,
-			  cur_step,
-			  layer_comms[i],
-			  &layer_fetch_requests[i]);
+    // Complete layer i's fetches, waiting while its weights are older
+    // than min_step. Each version received is newer than the one in use,
+    // so the layer switches to it.
+    void ProgressWeightFetch(int i, int min_step) {
+	PostWeightFetch(i);
+	while (fetch_version[i] >= 0) {
+	    int v = fetch_version[i], completed = 0;
+	    if (layer_cur_step[i] < min_step) {
+		MPI_Wait(weight_versions[i]->Requests(v), MPI_STATUS_IGNORE);
+		completed = 1;
 	    }
+	    else {
+		MPI_Test(weight_versions[i]->Requests(v), &completed, MPI_STATUS_IGNORE);
+	    }
+	    if (!completed) return;
+
+	    fetch_version[i] = -1;
+	    front_version[i] = v;
+	    received_step[i] = layer_cur_step[i] = weight_versions[i]->Step(v);
+	    layers[i]->weights = weight_versions[i]->Buffer(v);
+	    PostWeightFetch(i);
+	}
+    }
+
+    // The master waits for every version it sent before it leaves.
+    void DrainWeightFetches() {
+	if (transport) return;
+	for (int i = 0; i < layers.size()-1; i++) {
+	    ProgressWeightFetch(i, run_config.n_train_iters-1);
 	}
     }
 };
@@ -3,21 +3,73 @@
 #include <unistd.h>
 #include "distributed/distributed_defines.h"
 #include "distributed/worker_nn.h"
+#include "distributed/local_sgd_worker_nn.h"
 #include "distributed/sync_replicas_master_nn.h"
+#include "distributed/async_staleness_master_nn.h"
 #include "distributed/evaluator_nn.h"
+#include "distributed/thread_budget.h"
+#include "distributed/shared_memory_transport.h"
+#include "distributed/rma_master_nn.h"
+#include "distributed/rma_worker_nn.h"
+#include "distributed/dataset_shard.h"
+#include "distributed/step_notifier.h"
+#include "distributed/node_aggregator.h"
 
-int main(void) {
+int main(int argc, char **argv) {
     srand(time(NULL));
 
     std::cout << std::fixed << std::showpoint;
     std::cout << std::setprecision(10);
 
-    // Initialize the MPI environment
-    MPI_Init(NULL, NULL);
+    // Threads that exist before MPI_Init are ours and BLAS's.
+    std::vector<pid_t> compute_threads = ThreadBudget::ListThreads();
+
+    // Initialize the MPI environment. Only the main thread makes MPI
+    // calls; the evaluator evaluates, and a computing master computes, on
+    // a second thread.
+    int thread_support;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_support);
+    if (thread_support < MPI_THREAD_FUNNELED) {
+	std::cout << "MPI does not support MPI_THREAD_FUNNELED" << std::endl;
+	exit(-1);
+    }
+    run_config.ParseArgs(argc, argv);
+
+    // The RMA master never looks for gradients of its own.
+    if (RMA_PARAMETER_SERVER && run_config.master_computes) {
+	std::cout << "master_computes is not supported with RMA_PARAMETER_SERVER" << std::endl;
+	exit(-1);
+    }
+
+    // RMA workers accumulate into the master's window directly.
+    if (RMA_PARAMETER_SERVER && run_config.hierarchical_aggregation) {
+	std::cout << "hierarchical_aggregation is not supported with RMA_PARAMETER_SERVER" << std::endl;
+	exit(-1);
+    }
+
+    // A node sum holds one step, so the leader would drop the gradients
+    // of workers within the staleness bound but on other steps.
+    if (STALENESS > 0 && run_config.hierarchical_aggregation) {
+	std::cout << "hierarchical_aggregation is not supported with STALENESS > 0" << std::endl;
+	exit(-1);
+    }
+
+    ThreadBudget *thread_budget = NULL;
+    int blas_threads = openblas_get_num_threads ? openblas_get_num_threads() : 1;
+    if (THREAD_BUDGET) {
+	thread_budget = new ThreadBudget(MPI_COMM_WORLD, compute_threads, RESERVE_PROGRESS_CORE);
+	thread_budget->Apply();
+	thread_budget->PrintLayout();
+	blas_threads = thread_budget->ComputeThreads();
+    }
+    if (run_config.parallel_loops) {
+	task_pool.Start(thread_budget ? thread_budget->ComputeCPUs() : ThreadBudget::OrderedCPUs());
+    }
 
     // Get the number of processes
     int n_procs;
     MPI_Comm_size(MPI_COMM_WORLD, &n_procs);
+    run_config.Validate(n_procs);
 
     // Get the rank of the process
     int rank;
@@ -31,29 +83,55 @@ int main(void) {
     char hostname[1024];
     gethostname(hostname, 1024);
 
+    if (rank == MASTER_RANK) {
+	run_config.Print();
+	std::cout << "Collecting " << run_config.NToCollect(n_procs) << " of "
+		  << run_config.NWorkers(n_procs) << " workers" << std::endl;
+    }
+
     // Set NN Params
     NNParams *params = new NNParams();
-    int batch_size = 128;
+    int batch_size = run_config.batch_size;
     params->SetBatchsize(batch_size);
     params->AddLayer(batch_size, IMAGE_X*IMAGE_Y);
-    params->AddLayer(IMAGE_X*IMAGE_Y, 500);
-    params->AddLayer(500, 500);
-    params->AddLayer(500, 800);
-    params->AddLayer(800, 800);
-    params->AddLayer(800, 200);
-    params->AddLayer(200, 100);
-    params->AddLayer(100, 100);
-    params->AddLayer(100, N_CLASSES);
-    params->SetLearningRate(1e-3);
-
-    // Load data
-    int number_of_images, number_of_test_images, image_size;
-    int number_of_labels, number_of_test_labels;
-    uchar **images = read_mnist_images(TRAINING_IMAGES, number_of_images, image_size);
-    uchar *labels = read_mnist_labels(TRAINING_LABELS, number_of_labels);
-    uchar **test_images = read_mnist_images(TEST_IMAGES, number_of_test_images, image_size);
-    uchar *test_labels = read_mnist_labels(TEST_LABELS, number_of_test_labels);
-    MNISTShuffleDataAndLabels(images, labels, number_of_images);
+    params->SetShape(1, IMAGE_Y, IMAGE_X);
+    int pool = 1;
+    for (int i = 0; i < run_config.conv_layers.size(); i++) {
+	ConvSpec conv = run_config.conv_layers[i];
+	if (conv.channels == 0) {
+	    pool = conv.pool;
+	    continue;
+	}
+	params->AddConvLayer(conv.channels, conv.kernel, pool);
+	pool = 1;
+    }
+    std::vector<int> dense_layers = run_config.hidden_layers;
+    dense_layers.push_back(N_CLASSES);
+    for (int i = 0; i < dense_layers.size(); i++) {
+	int previous_dimension = params->GetLayers().back().second;
+	if (pool > 1) {
+	    params->AddPooledLayer(dense_layers[i], pool);
+	    pool = 1;
+	}
+	else {
+	    params->AddLayer(previous_dimension, dense_layers[i]);
+	}
+    }
+    params->SetLearningRate(run_config.learning_rate);
+    params->SetMicroBatches(run_config.micro_batches);
+
+    // Load data. The evaluator reads the training set once and scatters
+    // a shard to each worker; only it needs the test set.
+    double load_start = GetTimeMillis();
+    DatasetShard *shard = new DatasetShard(MPI_COMM_WORLD, EVALUATOR_RANK, TRAINING_IMAGES, TRAINING_LABELS);
+    int number_of_test_images = 0, number_of_test_labels, image_size;
+    uchar **test_images = NULL, *test_labels = NULL;
+    if (rank == EVALUATOR_RANK) {
+	test_images = read_mnist_images(TEST_IMAGES, number_of_test_images, image_size);
+	test_labels = read_mnist_labels(TEST_LABELS, number_of_test_labels);
+    }
+    std::cout << "Rank " << rank << " loaded " << shard->n_examples << " training examples in "
+	      << GetTimeMillis() - load_start << " ms" << std::endl;
 
     std::vector<MPI_Comm> layer_comms(params->GetLayers().size());
     for (int i = 0; i < layer_comms.size(); i++) {
@@ -62,25 +140,112 @@ int main(void) {
 
     std::cout << "Machine launched: " << hostname << std::endl;
 
+    std::vector<size_t> layer_counts;
+    for (int i = 0; i < params->GetLayers().size()-1; i++) {
+	layer_counts.push_back(params->GetLayerCount(i));
+    }
+
+    // Both are collective, so every rank builds the one in use.
+    SharedMemoryTransport *transport = NULL;
+    RMAParameterStore *store = NULL;
+    if (RMA_PARAMETER_SERVER) {
+	store = new RMAParameterStore(MPI_COMM_WORLD, layer_counts);
+    }
+    else if (SHARED_MEMORY_TRANSPORT) {
+	transport = new SharedMemoryTransport(MPI_COMM_WORLD, layer_counts, STALENESS+2);
+    }
+
+    StepNotifier *notifier = NULL;
+    if (STEP_NOTIFIER) {
+	notifier = new StepNotifier(MPI_COMM_WORLD);
+    }
+
+    // Also collective; groups the workers by node once transport knows
+    // which share the master's.
+    NodeAggregator *aggregator = NULL;
+    if (run_config.hierarchical_aggregation) {
+	aggregator = new NodeAggregator(MPI_COMM_WORLD, layer_counts, transport);
+    }
+
+    SyncReplicasMasterNN *master = NULL;
     if (rank == MASTER_RANK) {
-	SyncReplicasMasterNN *master = new SyncReplicasMasterNN(params, layer_comms, n_procs, n_procs-2-4);
-	master->Train(test_images, test_labels, number_of_test_images);
-	delete master;
+	int n_to_collect = run_config.NToCollect(n_procs);
+	if (RMA_PARAMETER_SERVER) {
+	    master = new RMAMasterNN(params, layer_comms, n_procs, n_to_collect, STALENESS, store);
+	}
+	else if (STALENESS > 0) {
+	    master = new AsyncStalenessMasterNN(params, layer_comms, n_procs, n_to_collect,
+						STALENESS, STALENESS_AWARE_LR);
+	}
+	else {
+	    master = new SyncReplicasMasterNN(params, layer_comms, n_procs, n_to_collect);
+	}
+	if (transport) {
+	    master->UseSharedMemory(transport);
+	}
+	if (notifier) {
+	    master->UseStepNotifier(notifier);
+	}
+	master->Train(shard->images, shard->labels, shard->n_examples);
+	if (run_config.model_file != "") {
+	    master->SaveModel(run_config.model_file, params);
+	    std::cout << "Saved model to " << run_config.model_file << std::endl;
+	}
+	task_pool.Print();
     }
     else if (rank == EVALUATOR_RANK) {
 	EvaluatorNN *evaluator = new EvaluatorNN(params, layer_comms, rank, n_procs);
+	if (run_config.tune_gemms) {
+	    evaluator->TuneGemms(blas_threads, run_config.gemm_tuning_file);
+	    gemm_tuner.Print();
+	}
 	evaluator->Train(test_images, test_labels, number_of_test_images);
 	delete evaluator;
     }
     else {
-	WorkerNN *worker = new WorkerNN(params, layer_comms, rank, n_procs);
-	worker->Train(test_images, test_labels, number_of_test_images);
+	WorkerNN *worker;
+	if (RMA_PARAMETER_SERVER) {
+	    worker = new RMAWorkerNN(params, layer_comms, rank, n_procs, STALENESS, store);
+	}
+	else if (LOCAL_SGD_STEPS > 1) {
+	    worker = new LocalSGDWorkerNN(params, layer_comms, rank, n_procs,
+					  LOCAL_SGD_STEPS, LOCAL_SGD_ADAPTIVE);
+	}
+	else {
+	    worker = new WorkerNN(params, layer_comms, rank, n_procs, STALENESS);
+	}
+	if (run_config.tune_gemms) {
+	    worker->TuneGemms(blas_threads, run_config.gemm_tuning_file);
+	}
+	if (transport) {
+	    worker->UseSharedMemory(transport);
+	}
+	if (notifier) {
+	    worker->UseStepNotifier(notifier);
+	}
+	if (aggregator) {
+	    worker->UseNodeAggregator(aggregator);
+	}
+	worker->Train(shard->images, shard->labels, shard->n_examples);
 	delete worker;
     }
 
-    delete params;
-
+    // Workers have sent every gradient the master accepted by now, so
+    // its receives still posted will never match.
     MPI_Barrier(MPI_COMM_WORLD);
+    if (master) {
+	master->CancelGradientFetches();
+	delete master;
+    }
+
+    delete params;
+    delete shard;
+    delete transport;
+    delete store;
+    delete notifier;
+    delete aggregator;
+    delete thread_budget;
+    task_pool.Stop();
 
     // Finalize the MPI environment.
     MPI_Finalize();
@@ -9,6 +9,7 @@
 #include <fstream>
 #include <iterator>
 #include <algorithm>
+#include "../util/task_pool.h"
 
 using namespace std;
 
@@ -100,12 +101,13 @@ void test_load_labels(string path, int n_expected) {
 }
 
 void MNISTImageToInput(int batchsize, uchar **images, double *output) {
-
-    for (int i = 0; i < batchsize; i++) {
-	for (int j = 0; j < IMAGE_X*IMAGE_Y; j++) {
-	    output[i * IMAGE_X*IMAGE_Y + j] = images[i][j] / (double)255;
+    task_pool.ParallelFor(0, batchsize, TASK_POOL_GRAIN / (IMAGE_X*IMAGE_Y), [&](long first, long last) {
+	for (long i = first; i < last; i++) {
+	    for (int j = 0; j < IMAGE_X*IMAGE_Y; j++) {
+		output[i * IMAGE_X*IMAGE_Y + j] = images[i][j] / (double)255;
+	    }
 	}
-    }
+    });
 }
 
 void MNISTOneHotLabelsToInput(int batchsize, uchar *labels, double *output) {
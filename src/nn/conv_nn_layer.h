@@ -0,0 +1,213 @@
+#ifndef _CONV_NN_LAYER_
+#define _CONV_NN_LAYER_
+
+#include "nn_layer.h"
+#include "nn_params.h"
+
+// Bytes of im2col patches extracted at a time. The patches of a tile of
+// output rows are multiplied while they are still in cache.
+#ifndef CONV_TILE_BYTES
+#define CONV_TILE_BYTES (32*1024)
+#endif
+
+// A layer connected to the next one by max pooling then a convolution
+// (see ConvShape). Units are laid out channel, row, column, so a
+// convolution can feed or follow fully connected layers unchanged.
+//
+// The weights are a (channels*kernel*kernel+1) x out_channels matrix
+// whose last row is the bias. Each example's pooled maps are unrolled
+// into patch columns (im2col) a tile of output rows at a time, and
+// next->S = W^T * patches is one gemm per tile. Back propagation runs
+// the same gemms transposed and folds the patch gradients back into the
+// maps (col2im).
+class ConvNNLayer : public NNLayer {
+ public:
+    ConvNNLayer(int batchsize, int n_rows, int n_cols, ConvShape shape, bool is_input, int step, double learning_rate) :
+	NNLayer(batchsize, n_rows, n_cols, is_input, false, step, learning_rate,
+		shape.channels * shape.kernel * shape.kernel + 1,
+		n_cols / (shape.OutHeight() * shape.OutWidth())) {
+	assert(shape.channels * shape.height * shape.width == n_rows);
+	assert(weight_cols * shape.OutHeight() * shape.OutWidth() == n_cols);
+	this->shape = shape;
+	pooled_size = shape.channels * shape.PooledHeight() * shape.PooledWidth();
+	out_size = shape.OutHeight() * shape.OutWidth();
+
+	tile_rows = CONV_TILE_BYTES / (sizeof(double) * weight_rows * shape.OutWidth());
+	tile_rows = std::max(1, std::min(shape.OutHeight(), tile_rows));
+	AllocateMemory(&patches, weight_rows * tile_rows * shape.OutWidth());
+	AllocateMemory(&patch_grad, weight_rows * tile_rows * shape.OutWidth());
+	AllocateMemory(&pooled_grad, pooled_size);
+
+	pooled = NULL;
+	if (shape.pool > 1) {
+	    AllocateMemory(&pooled, batchsize * pooled_size);
+	    pool_argmax.resize((size_t)batchsize * pooled_size);
+	}
+    }
+
+    void ForwardPropagateCore(double *data) override {
+	memset(next->S, 0, sizeof(double) * batchsize * n_cols);
+
+	if (is_input) {
+	    for (int i = 0; i < batchsize; i++) {
+		memcpy(&input[i*(n_rows+1)], &data[i*n_rows], sizeof(double) * n_rows);
+	    }
+	}
+	else {
+	    SigmoidActivationAndGradient(S, Z, F, batchsize, n_rows, n_rows, n_rows+1, n_rows);
+	}
+
+	for (int b = 0; b < batchsize; b++) {
+	    double *maps = Maps(b);
+	    if (shape.pool > 1) {
+		MaxPool(maps, &pooled[b*pooled_size], &pool_argmax[(size_t)b*pooled_size]);
+	    }
+	    for (int row = 0; row < shape.OutHeight(); row += tile_rows) {
+		int n_tile = TileColumns(row);
+
+		// Compute S_j = W_i^T * patches
+		Im2Col(PooledMaps(b), row, n_tile);
+		MatrixMultiplyTransA(weights, patches, &next->S[b*n_cols + row*shape.OutWidth()],
+				     weight_cols, n_tile, weight_rows,
+				     weight_cols, n_tile, out_size);
+	    }
+	}
+    }
+
+    void BackPropagateCore(double *labels, bool accumulate = false) override {
+	if (!accumulate) {
+	    memset(grad, 0, sizeof(double) * GetLayerCount());
+	}
+	memset(D, 0, sizeof(double) * n_rows * batchsize);
+
+	for (int b = 0; b < batchsize; b++) {
+	    double *next_D = &next->D[b*n_cols];
+	    if (!is_input) {
+		memset(pooled_grad, 0, sizeof(double) * pooled_size);
+	    }
+	    for (int row = 0; row < shape.OutHeight(); row += tile_rows) {
+		int n_tile = TileColumns(row);
+		double *tile_D = &next_D[row*shape.OutWidth()];
+
+		// Compute grad += patches * D_j^T
+		Im2Col(PooledMaps(b), row, n_tile);
+		MatrixMultiplyTransB(patches, tile_D, grad,
+				     weight_rows, weight_cols, n_tile,
+				     n_tile, out_size, weight_cols);
+
+		// The input layer's D is never used.
+		if (is_input) continue;
+
+		// Compute W_i * D_j and fold it back into the maps
+		memset(patch_grad, 0, sizeof(double) * weight_rows * n_tile);
+		MatrixMultiply(weights, tile_D, patch_grad,
+			       weight_rows, n_tile, weight_cols,
+			       weight_cols, out_size, n_tile);
+		Col2Im(pooled_grad, row, n_tile);
+	    }
+	    if (is_input) continue;
+
+	    // Route the pooled gradient to the maxima, then compute D'
+	    double *example_D = &D[b*n_rows];
+	    if (shape.pool > 1) {
+		int *argmax = &pool_argmax[(size_t)b*pooled_size];
+		for (int i = 0; i < pooled_size; i++) {
+		    example_D[argmax[i]] += pooled_grad[i];
+		}
+	    }
+	    else {
+		memcpy(example_D, pooled_grad, sizeof(double) * n_rows);
+	    }
+	    MultiplyEntrywise(example_D, &F[b*n_rows], example_D,
+			      1, n_rows, n_rows, n_rows, n_rows);
+	}
+    }
+
+    ~ConvNNLayer() {
+	free(patches);
+	free(patch_grad);
+	free(pooled_grad);
+	if (pooled != NULL) free(pooled);
+    }
+
+ protected:
+    ConvShape shape;
+    int pooled_size, out_size, tile_rows;
+    double *patches, *patch_grad, *pooled, *pooled_grad;
+    std::vector<int> pool_argmax;
+
+    // Example b's activations, channels x height x width.
+    double *Maps(int b) {
+	return is_input ? &input[b*(n_rows+1)] : &Z[b*(n_rows+1)];
+    }
+
+    double *PooledMaps(int b) {
+	return shape.pool > 1 ? &pooled[b*pooled_size] : Maps(b);
+    }
+
+    // Patch columns in the tile of output rows starting at row.
+    int TileColumns(int row) {
+	return std::min(tile_rows, shape.OutHeight() - row) * shape.OutWidth();
+    }
+
+    void MaxPool(double *maps, double *out, int *argmax) {
+	int height = shape.PooledHeight(), width = shape.PooledWidth();
+	for (int c = 0; c < shape.channels; c++) {
+	    for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+		    int best = c*shape.height*shape.width + y*shape.pool*shape.width + x*shape.pool;
+		    for (int dy = 0; dy < shape.pool; dy++) {
+			for (int dx = 0; dx < shape.pool; dx++) {
+			    int index = c*shape.height*shape.width + (y*shape.pool+dy)*shape.width + x*shape.pool+dx;
+			    if (maps[index] > maps[best]) best = index;
+			}
+		    }
+		    int out_index = (c*height + y)*width + x;
+		    out[out_index] = maps[best];
+		    argmax[out_index] = best;
+		}
+	    }
+	}
+    }
+
+    // patches[(c*kernel+ky)*kernel+kx][(y-row)*out_width+x] =
+    // maps[c][y+ky][x+kx] for the tile's output rows y, plus a row of
+    // ones for the bias. Each patch row is a run of map row copies.
+    void Im2Col(double *maps, int row, int n_tile) {
+	int height = shape.PooledHeight(), width = shape.PooledWidth();
+	int out_width = shape.OutWidth(), n_tile_rows = n_tile / out_width;
+	for (int c = 0; c < shape.channels; c++) {
+	    for (int ky = 0; ky < shape.kernel; ky++) {
+		for (int kx = 0; kx < shape.kernel; kx++) {
+		    double *patch_row = &patches[((c*shape.kernel + ky)*shape.kernel + kx) * n_tile];
+		    for (int y = 0; y < n_tile_rows; y++) {
+			memcpy(&patch_row[y*out_width], &maps[(c*height + row+y+ky)*width + kx],
+			       sizeof(double) * out_width);
+		    }
+		}
+	    }
+	}
+	std::fill(&patches[(weight_rows-1) * n_tile], &patches[weight_rows * n_tile], 1);
+    }
+
+    // Adds patch_grad back into the maps it was unrolled from.
+    void Col2Im(double *maps, int row, int n_tile) {
+	int height = shape.PooledHeight(), width = shape.PooledWidth();
+	int out_width = shape.OutWidth(), n_tile_rows = n_tile / out_width;
+	for (int c = 0; c < shape.channels; c++) {
+	    for (int ky = 0; ky < shape.kernel; ky++) {
+		for (int kx = 0; kx < shape.kernel; kx++) {
+		    double *patch_row = &patch_grad[((c*shape.kernel + ky)*shape.kernel + kx) * n_tile];
+		    for (int y = 0; y < n_tile_rows; y++) {
+			double *map_row = &maps[(c*height + row+y+ky)*width + kx];
+			for (int x = 0; x < out_width; x++) {
+			    map_row[x] += patch_row[y*out_width + x];
+			}
+		    }
+		}
+	    }
+	}
+    }
+};
+
+#endif
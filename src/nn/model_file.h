@@ -0,0 +1,127 @@
+#ifndef _MODEL_FILE_
+#define _MODEL_FILE_
+
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <unistd.h>
+#include "nn_params.h"
+#include "nn_layer.h"
+
+// A trained network on disk: a text header describing the layers, then
+// each weighted layer's weights as raw doubles, in layer order.
+//
+//   nn_model 1
+//   layers 784 500 10
+//   conv <layer> <channels> <height> <width> <kernel> <pool>   (one per convolution)
+//   weights
+//   <binary weights>
+class ModelFile {
+ public:
+    ModelFile(string path) {
+	std::ifstream file(path, std::ios::binary);
+	string line, word;
+	int version = 0;
+	if (!file.is_open() || !std::getline(file, line) ||
+	    !(std::stringstream(line) >> word >> version) || word != "nn_model" || version != 1) {
+	    Invalid(path);
+	}
+	while (std::getline(file, line) && line != "weights") {
+	    std::stringstream fields(line);
+	    fields >> word;
+	    if (word == "layers") {
+		int dimension;
+		while (fields >> dimension) {
+		    dimensions.push_back(dimension);
+		}
+	    }
+	    else if (word == "conv") {
+		int layer;
+		ConvShape shape;
+		if (!(fields >> layer >> shape.channels >> shape.height >> shape.width >> shape.kernel >> shape.pool)) {
+		    Invalid(path);
+		}
+		convolutions[layer] = shape;
+	    }
+	    else {
+		Invalid(path);
+	    }
+	}
+
+	if (dimensions.size() < 2) {
+	    Invalid(path);
+	}
+	NNParams *params = Params(1);
+	for (int i = 0; i < dimensions.size()-1; i++) {
+	    weights.push_back(std::vector<double>(params->GetLayerCount(i)));
+	    file.read((char *)weights[i].data(), sizeof(double) * weights[i].size());
+	}
+	delete params;
+	if (!file) {
+	    Invalid(path);
+	}
+    }
+
+    // Written aside and renamed, so a reader never sees half a model.
+    static void Save(string path, NNParams *params, std::vector<NNLayer *> &layers) {
+	string temporary = path + "." + std::to_string(getpid());
+	std::ofstream file(temporary, std::ios::binary);
+	file << "nn_model 1" << std::endl << "layers";
+	for (int i = 0; i < params->GetLayers().size(); i++) {
+	    file << " " << params->GetLayers()[i].second;
+	}
+	file << std::endl;
+	for (int i = 0; i < layers.size()-1; i++) {
+	    if (params->IsConvolution(i)) {
+		ConvShape shape = params->GetConvShape(i);
+		file << "conv " << i << " " << shape.channels << " " << shape.height << " " << shape.width
+		     << " " << shape.kernel << " " << shape.pool << std::endl;
+	    }
+	}
+	file << "weights" << std::endl;
+	for (int i = 0; i < layers.size()-1; i++) {
+	    file.write((char *)layers[i]->GetLayer(), sizeof(double) * layers[i]->GetLayerCount());
+	}
+	file.close();
+	std::rename(temporary.c_str(), path.c_str());
+    }
+
+    // The network's parameters, for batches of batchsize. The caller
+    // owns them.
+    NNParams *Params(int batchsize) {
+	NNParams *params = new NNParams();
+	params->SetBatchsize(batchsize);
+	params->SetLearningRate(0);
+	params->AddLayer(batchsize, dimensions[0]);
+	for (int i = 0; i < dimensions.size()-1; i++) {
+	    if (convolutions.count(i)) {
+		ConvShape shape = convolutions[i];
+		params->SetShape(shape.channels, shape.height, shape.width);
+		params->AddConvLayer(dimensions[i+1] / (shape.OutHeight() * shape.OutWidth()), shape.kernel, shape.pool);
+	    }
+	    else {
+		params->AddLayer(dimensions[i], dimensions[i+1]);
+	    }
+	}
+	return params;
+    }
+
+    void CopyWeights(std::vector<NNLayer *> &layers) {
+	for (int i = 0; i < weights.size(); i++) {
+	    assert(weights[i].size() == layers[i]->GetLayerCount());
+	    memcpy(layers[i]->GetLayer(), weights[i].data(), sizeof(double) * weights[i].size());
+	}
+    }
+
+ protected:
+    std::vector<int> dimensions;
+    std::map<int, ConvShape> convolutions;
+    std::vector<std::vector<double> > weights;
+
+    static void Invalid(string path) {
+	std::cout << "Invalid model file: " << path << std::endl;
+	exit(-1);
+    }
+};
+
+#endif
@@ -7,6 +7,8 @@
 #include <vector>
 #include "nn_params.h"
 #include "nn_layer.h"
+#include "conv_nn_layer.h"
+#include "model_file.h"
 #include "../mnist/mnist.h"
 
 class NN {
@@ -16,12 +18,20 @@ class NN {
 	// Set parameters
 	this->batchsize = params->GetBatchsize();
 	this->learning_rate = params->GetLearningRate();
+	this->n_micro_batches = params->GetMicroBatches();
 	params->Validate(batchsize, N_CLASSES);
 
 	// Allocate memory for layers
 	for (int i = 0; i < params->GetLayers().size()-1; i++) {
 	    std::pair<int, int> layer = params->GetLayers()[i];
 	    std::pair<int, int> next_layer = params->GetLayers()[i+1];
+	    if (params->IsConvolution(i)) {
+		layers.push_back(new ConvNNLayer(batchsize,
+						 layer.second, next_layer.second,
+						 params->GetConvShape(i),
+						 i == 0, 0, learning_rate));
+		continue;
+	    }
 	    layers.push_back(new NNLayer(batchsize,
 					 layer.second, next_layer.second,
 					 i == 0,
@@ -53,9 +63,13 @@ class NN {
     virtual void Train(uchar **data, uchar *labels, int n_examples) {
 
 	while (true) {
-	    bool finished_epoch = FillNextBatch(data, labels, n_examples);
-	    ForwardPropagate(batch_data_placeholder);
-	    BackPropagate(batch_labels_placeholder);
+	    bool finished_epoch = false;
+	    for (int m = 0; m < n_micro_batches; m++) {
+		finished_epoch = FillNextBatch(data, labels, n_examples) || finished_epoch;
+		ForwardPropagate(batch_data_placeholder);
+		ComputeGradients(batch_labels_placeholder, m > 0);
+	    }
+	    ApplyGradients();
 	    if (finished_epoch) break;
 	}
 
@@ -95,7 +109,26 @@ class NN {
 	return n_wrong / n_seen;
     }
 
-    ~NN() {
+    // Runs a batch to record the network's gemm shapes, then has
+    // gemm_tuner pick BLAS threads for each (see gemm_tuner.h). Leaves
+    // the weights alone.
+    void TuneGemms(int max_threads, string cache_path) {
+	int n_features = layers[0]->Dimension();
+	int n_outputs = layers[layers.size()-1]->Dimension();
+	std::fill(batch_data_placeholder, batch_data_placeholder + batchsize * n_features, 1);
+	memset(batch_labels_placeholder, 0, sizeof(double) * batchsize * n_outputs);
+	gemm_tuner.StartRecording();
+	ForwardPropagate(batch_data_placeholder);
+	ComputeGradients(batch_labels_placeholder, false);
+	gemm_tuner.Tune(max_threads, cache_path);
+    }
+
+    // Saves the weights with the shape in params, for ModelFile to load.
+    void SaveModel(string path, NNParams *params) {
+	ModelFile::Save(path, params, layers);
+    }
+
+    virtual ~NN() {
 	for (int i = 0; i < layers.size(); i++) {
 	    delete layers[i];
 	}
@@ -106,7 +139,7 @@ class NN {
  protected:
     std::vector<NNLayer *> layers;
     double *batch_data_placeholder, *batch_labels_placeholder;
-    int batchsize;
+    int batchsize, n_micro_batches;
     double learning_rate;
 
     double ComputeBatchLoss(double *data, double *labels, int n_examples) {
@@ -114,13 +147,14 @@ class NN {
 	ForwardPropagate(data);
 	NNLayer *last = layers[layers.size()-1];
 	double *predictions = last->Output();
-	double loss = 0;
-	for (int i = 0; i < n_examples; i++) {
-	    loss += LogDot(&predictions[i*last->Dimension()],
-			   &labels[i*last->Dimension()],
-			   last->Dimension());
-	}
-	return loss;
+	int n_outputs = last->Dimension();
+	return task_pool.ParallelReduce(0, n_examples, RowGrain(n_outputs), 0.0, [&](long first, long last) {
+	    double loss = 0;
+	    for (long i = first; i < last; i++) {
+		loss += LogDot(&predictions[i*n_outputs], &labels[i*n_outputs], n_outputs);
+	    }
+	    return loss;
+	}, std::plus<double>());
     }
 
     // Fills in next batch of data into batch_data_placeholder
@@ -153,6 +187,20 @@ class NN {
     void BackPropagate(double *labels) {
 	layers[layers.size()-1]->BackPropagate(labels);
     }
+
+    // Back propagate without updating the weights, summing into the
+    // gradients of the previous micro-batches if accumulate is set.
+    void ComputeGradients(double *labels, bool accumulate) {
+	for (int i = layers.size()-1; i >= 0; i--) {
+	    layers[i]->BackPropagateCore(labels, accumulate);
+	}
+    }
+
+    void ApplyGradients() {
+	for (int i = 0; i < layers.size()-1; i++) {
+	    layers[i]->ApplyGrad(learning_rate, layers[i]->GetGradient());
+	}
+    }
 };
 
 void test_nn() {
@@ -174,6 +222,7 @@ void test_nn() {
     params->AddLayer(IMAGE_X*IMAGE_Y, 100);
     params->AddLayer(100, N_CLASSES);
     params->SetLearningRate(1e-2);
+    params->SetMicroBatches(MICRO_BATCHES);
     NN *nn = new NN(params);
     int number_of_images, number_of_test_images, image_size;
     int number_of_labels, number_of_test_labels;
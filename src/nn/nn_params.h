@@ -3,11 +3,32 @@
 
 #include <iostream>
 #include <vector>
+#include <map>
+
+// Batches summed into each step's gradient (see SetMicroBatches).
+#ifndef MICRO_BATCHES
+#define MICRO_BATCHES 1
+#endif
+
+// How a layer's units are laid out and connected to the next layer's.
+// The units are channels x height x width feature maps; they are max
+// pooled pool x pool, then convolved with kernel x kernel filters (no
+// padding, stride 1). A kernel covering the whole pooled map connects
+// the layers fully.
+struct ConvShape {
+    int channels, height, width, kernel, pool;
+
+    int PooledHeight() { return height / pool; }
+    int PooledWidth() { return width / pool; }
+    int OutHeight() { return PooledHeight() - kernel + 1; }
+    int OutWidth() { return PooledWidth() - kernel + 1; }
+};
 
 class NNParams {
  public:
 
     NNParams() {
+	n_micro_batches = 1;
     }
 
     ~NNParams() {
@@ -15,6 +36,64 @@ class NNParams {
 
     void AddLayer(int in_layer_dim, int out_layer_dim) {
 	layers.push_back(std::make_pair(in_layer_dim, out_layer_dim));
+	shape = {out_layer_dim, 1, 1, 1, 1};
+    }
+
+    // Lays the last added layer out as channels x height x width maps,
+    // e.g. the input image, so convolutions can follow it.
+    void SetShape(int channels, int height, int width) {
+	if (channels * height * width != layers[layers.size()-1].second) {
+	    std::cout << "Shape " << channels << "x" << height << "x" << width
+		      << " does not match layer dimension " << layers[layers.size()-1].second << std::endl;
+	    exit(-1);
+	}
+	shape = {channels, height, width, 1, 1};
+    }
+
+    // Adds a layer of out_channels maps computed by pooling then
+    // convolving the last added layer.
+    void AddConvLayer(int out_channels, int kernel, int pool = 1) {
+	ConvShape conv = shape;
+	conv.kernel = kernel;
+	conv.pool = pool;
+	if (conv.OutHeight() < 1 || conv.OutWidth() < 1) {
+	    std::cout << "Kernel " << kernel << " does not fit " << conv.PooledHeight() << "x"
+		      << conv.PooledWidth() << " maps" << std::endl;
+	    exit(-1);
+	}
+	int in_dim = layers[layers.size()-1].second;
+	convolutions[layers.size()-1] = conv;
+	layers.push_back(std::make_pair(in_dim, out_channels * conv.OutHeight() * conv.OutWidth()));
+	shape = {out_channels, conv.OutHeight(), conv.OutWidth(), 1, 1};
+    }
+
+    // Adds a fully connected layer after pooling the last added layer.
+    void AddPooledLayer(int out_layer_dim, int pool) {
+	ConvShape conv = shape;
+	conv.pool = pool;
+	if (conv.PooledHeight() != conv.PooledWidth()) {
+	    std::cout << "Pooled maps must be square" << std::endl;
+	    exit(-1);
+	}
+	AddConvLayer(out_layer_dim, conv.PooledHeight(), pool);
+    }
+
+    // Whether layer i is connected to layer i+1 by a convolution, and how.
+    bool IsConvolution(int i) {
+	return convolutions.count(i) > 0;
+    }
+
+    ConvShape GetConvShape(int i) {
+	return convolutions[i];
+    }
+
+    // Parameters connecting layer i to layer i+1.
+    size_t GetLayerCount(int i) {
+	if (IsConvolution(i)) {
+	    ConvShape conv = convolutions[i];
+	    return (size_t)(conv.channels * conv.kernel * conv.kernel + 1) * (layers[i+1].second / (conv.OutHeight() * conv.OutWidth()));
+	}
+	return (size_t)(layers[i].second+1) * layers[i+1].second;
     }
 
     void Validate(int in_size, int out_size) {
@@ -50,6 +129,17 @@ class NNParams {
 	this->learning_rate = learning_rate;
     }
 
+    // A step's gradient is summed over this many batches, so the
+    // effective batch is n_micro_batches * batchsize while activations
+    // are only ever held for batchsize examples.
+    void SetMicroBatches(int n_micro_batches) {
+	this->n_micro_batches = n_micro_batches;
+    }
+
+    int GetMicroBatches() {
+	return n_micro_batches;
+    }
+
     int GetBatchsize() {
 	return batchsize;
     }
@@ -60,9 +150,13 @@ class NNParams {
 
  private:
 
-    int batchsize;
+    int batchsize, n_micro_batches;
     double learning_rate;
     std::vector<std::pair<int, int> > layers;
+    std::map<int, ConvShape> convolutions;
+
+    // Layout of the last added layer.
+    ConvShape shape;
 
     void LayerInputDimensionWrong(int index, int expected) {
 	std::cout << "Input dimension for nn is " << layers[index].first << " expected: " << expected << std::endl;
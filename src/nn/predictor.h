@@ -0,0 +1,184 @@
+#ifndef _PREDICTOR_
+#define _PREDICTOR_
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <deque>
+#include <chrono>
+#include "nn.h"
+#include "model_file.h"
+
+struct Prediction {
+    int label;
+    double probability;
+};
+
+// Serves predictions from a trained network.
+//
+// Predict() classifies one image on the caller's thread: for a fully
+// connected network each layer is a single gemv, with no batch to pad.
+// Submit() queues an image and returns at once; a batching thread
+// takes everything queued, up to the network's batchsize, once that
+// many are waiting or the oldest has waited max_delay_us, and runs them
+// as one gemm per layer of exactly that many rows. Both are safe to call
+// from any number of threads. Convolutional networks go through the
+// network's own batch forward pass, one batch at a time.
+class Predictor : public NN {
+ public:
+    Predictor(NNParams *params, ModelFile &model, int max_delay_us) : NN(params) {
+	model.CopyWeights(layers);
+	this->max_delay_us = max_delay_us;
+	fully_connected = true;
+	for (int i = 0; i < layers.size(); i++) {
+	    fully_connected = fully_connected && !params->IsConvolution(i);
+	}
+	stopping = false;
+	n_batches = n_batched = 0;
+	batch_thread = std::thread(&Predictor::BatchLoop, this);
+    }
+
+    ~Predictor() {
+	{
+	    std::lock_guard<std::mutex> lock(queue_mutex);
+	    stopping = true;
+	}
+	queue_cv.notify_all();
+	batch_thread.join();
+    }
+
+    Prediction Predict(uchar *image) {
+	Prediction prediction;
+	ForwardImages(&image, 1, &prediction);
+	return prediction;
+    }
+
+    std::future<Prediction> Submit(uchar *image) {
+	Request request;
+	request.image = image;
+	request.arrival = std::chrono::steady_clock::now();
+	std::future<Prediction> result = request.promise.get_future();
+	{
+	    std::lock_guard<std::mutex> lock(queue_mutex);
+	    queue.push_back(std::move(request));
+	}
+	queue_cv.notify_all();
+	return result;
+    }
+
+    void PrintStats() {
+	std::lock_guard<std::mutex> lock(queue_mutex);
+	std::cout << "Predictor batches: " << n_batches << ", mean size "
+		  << (double)n_batched / std::max(n_batches, 1LL) << " of at most " << batchsize << std::endl;
+    }
+
+ protected:
+    struct Request {
+	uchar *image;
+	std::promise<Prediction> promise;
+	std::chrono::steady_clock::time_point arrival;
+    };
+
+    int max_delay_us;
+    bool fully_connected;
+
+    // Guarded by queue_mutex.
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::deque<Request> queue;
+    bool stopping;
+    long long int n_batches, n_batched;
+    std::thread batch_thread;
+
+    // The network's own buffers, used for convolutional networks.
+    std::mutex network_mutex;
+
+    void BatchLoop() {
+	while (true) {
+	    std::vector<Request> batch;
+	    {
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		queue_cv.wait(lock, [this] { return stopping || !queue.empty(); });
+		if (queue.empty()) return;
+		std::chrono::steady_clock::time_point deadline =
+		    queue.front().arrival + std::chrono::microseconds(max_delay_us);
+		queue_cv.wait_until(lock, deadline, [this] { return stopping || queue.size() >= batchsize; });
+		while (!queue.empty() && batch.size() < batchsize) {
+		    batch.push_back(std::move(queue.front()));
+		    queue.pop_front();
+		}
+		n_batches++;
+		n_batched += batch.size();
+	    }
+
+	    std::vector<uchar *> images;
+	    for (int i = 0; i < batch.size(); i++) {
+		images.push_back(batch[i].image);
+	    }
+	    std::vector<Prediction> predictions(batch.size());
+	    ForwardImages(images.data(), batch.size(), predictions.data());
+	    for (int i = 0; i < batch.size(); i++) {
+		batch[i].promise.set_value(predictions[i]);
+	    }
+	}
+    }
+
+    void ForwardImages(uchar **images, int n_images, Prediction *predictions) {
+	NNLayer *last = layers[layers.size()-1];
+	int n_outputs = last->Dimension();
+	std::vector<double> probabilities((size_t)n_images * n_outputs);
+	if (fully_connected) {
+	    ForwardFullyConnected(images, n_images, probabilities.data());
+	}
+	else {
+	    std::lock_guard<std::mutex> lock(network_mutex);
+	    MNISTImageToInput(n_images, images, batch_data_placeholder);
+	    ForwardPropagate(batch_data_placeholder);
+	    memcpy(probabilities.data(), last->Output(), sizeof(double) * n_images * n_outputs);
+	}
+	for (int i = 0; i < n_images; i++) {
+	    int label = Argmax(&probabilities[i*n_outputs], n_outputs);
+	    predictions[i].label = label;
+	    predictions[i].probability = probabilities[i*n_outputs + label];
+	}
+    }
+
+    // Each layer's input carries a trailing 1 for the bias row, so a
+    // layer is S = [Z 1] * W: a gemv for one image, a gemm otherwise.
+    void ForwardFullyConnected(uchar **images, int n_images, double *probabilities) {
+	int n_inputs = layers[0]->Dimension();
+	std::vector<double> input((size_t)n_images * (n_inputs+1), 1), output;
+	for (int i = 0; i < n_images; i++) {
+	    MNISTImageToInput(1, &images[i], &input[i*(n_inputs+1)]);
+	    input[i*(n_inputs+1) + n_inputs] = 1;
+	}
+
+	for (int l = 0; l < layers.size()-1; l++) {
+	    int k = layers[l]->NRows(), n = layers[l]->NCols();
+	    bool last = l == layers.size()-2;
+	    output.assign((size_t)n_images * n, 0);
+	    if (n_images == 1) {
+		cblas_dgemv(CblasRowMajor, CblasTrans, k, n, 1, layers[l]->GetLayer(), n,
+			    input.data(), 1, 0, output.data(), 1);
+	    }
+	    else {
+		MatrixMultiply(input.data(), layers[l]->GetLayer(), output.data(),
+			       n_images, n, k,
+			       k, n, n);
+	    }
+
+	    if (last) {
+		for (int i = 0; i < n_images; i++) {
+		    Softmax(&output[i*n], &probabilities[i*n], n);
+		}
+	    }
+	    else {
+		input.assign((size_t)n_images * (n+1), 1);
+		SigmoidActivation(output.data(), input.data(), n_images, n, n, n+1);
+	    }
+	}
+    }
+};
+
+#endif
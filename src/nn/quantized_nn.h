@@ -0,0 +1,121 @@
+#ifndef _QUANTIZED_NN_
+#define _QUANTIZED_NN_
+
+#include "nn_layer.h"
+#include "../util/int8_gemm.h"
+
+// Activations are quantized to 0..INT8_ACTIVATION_LEVELS, which must
+// stay below 128 for int8_gemm.h.
+#define INT8_ACTIVATION_LEVELS 127
+
+// Inference only copy of a fully connected network, for evaluating
+// weight snapshots cheaply. Weights are quantized to int8 with one scale
+// per output unit (column), the largest magnitude in it mapping to 127;
+// biases stay in double. Pixels and sigmoid outputs, both in [0, 1], are
+// quantized to 7 bits with a fixed scale, so a layer is one integer gemm
+// (see int8_gemm.h) followed by a rescale of each column. The softmax
+// output is computed in double.
+class QuantizedNN {
+ public:
+    // dimensions[l] units in layer l, input first.
+    QuantizedNN(int batchsize, std::vector<int> dimensions) {
+	this->batchsize = batchsize;
+	this->dimensions = dimensions;
+	kernel = Int8ChooseKernel();
+	int n_outputs = dimensions.back();
+	for (int l = 0; l < dimensions.size(); l++) {
+	    int k_pad = Int8Pad(dimensions[l], 4);
+	    activations.push_back(std::vector<uint8_t>((size_t)batchsize * k_pad, 0));
+	    if (l == dimensions.size()-1) break;
+	    int n_pad = Int8Pad(dimensions[l+1], INT8_GEMM_GROUP);
+	    weights.push_back(std::vector<int8_t>((size_t)k_pad * n_pad, 0));
+	    scales.push_back(std::vector<double>(dimensions[l+1]));
+	    biases.push_back(std::vector<double>(dimensions[l+1]));
+	}
+	sums.resize((size_t)batchsize * Int8Pad(*std::max_element(dimensions.begin()+1, dimensions.end()), INT8_GEMM_GROUP));
+	AllocateMemory(&output, batchsize * n_outputs);
+	AllocateMemory(&logits, n_outputs);
+    }
+
+    ~QuantizedNN() {
+	free(output);
+	free(logits);
+    }
+
+    // Quantize the weights of layers, a network of the same dimensions.
+    void Quantize(std::vector<NNLayer *> &layers) {
+	for (int l = 0; l < weights.size(); l++) {
+	    double *w = layers[l]->GetLayer();
+	    int k = dimensions[l], n = dimensions[l+1], k_pad = Int8Pad(k, 4);
+	    assert(layers[l]->NRows() == k+1 && layers[l]->NCols() == n);
+	    for (int j = 0; j < n; j++) {
+		double largest = 0;
+		for (int i = 0; i < k; i++) {
+		    largest = std::max(largest, fabs(w[i*n+j]));
+		}
+		double scale = largest > 0 ? largest / 127 : 1;
+		for (int i = 0; i < k; i++) {
+		    weights[l][Int8PackedIndex(i, j, k_pad)] = (int8_t)lrint(w[i*n+j] / scale);
+		}
+		scales[l][j] = scale / INT8_ACTIVATION_LEVELS;
+		biases[l][j] = w[k*n+j];
+	    }
+	}
+    }
+
+    // Class probabilities for n_examples <= batchsize images, one row of
+    // the returned matrix each.
+    double *ForwardPropagate(uchar **images, int n_examples) {
+	assert(n_examples <= batchsize);
+	int k_pad = Int8Pad(dimensions[0], 4);
+	for (int b = 0; b < n_examples; b++) {
+	    for (int i = 0; i < dimensions[0]; i++) {
+		activations[0][b*k_pad+i] = (images[b][i] * INT8_ACTIVATION_LEVELS + 127) / 255;
+	    }
+	}
+
+	for (int l = 0; l < weights.size(); l++) {
+	    int n = dimensions[l+1];
+	    int k_pad = Int8Pad(dimensions[l], 4), n_pad = Int8Pad(n, INT8_GEMM_GROUP), out_pad = Int8Pad(n, 4);
+	    bool last = l == weights.size()-1;
+	    Int8Gemm(kernel, activations[l].data(), weights[l].data(), sums.data(),
+		     n_examples, n_pad, k_pad, k_pad, n_pad);
+	    for (int b = 0; b < n_examples; b++) {
+		for (int j = 0; j < n; j++) {
+		    double s = sums[b*n_pad+j] * scales[l][j] + biases[l][j];
+		    if (last) {
+			logits[j] = s;
+		    }
+		    else {
+			activations[l+1][b*out_pad+j] = (uint8_t)lrint(INT8_ACTIVATION_LEVELS / (1 + exp(-s)));
+		    }
+		}
+		if (last) {
+		    Softmax(logits, &output[b*n], n);
+		}
+	    }
+	}
+	return output;
+    }
+
+    const char *KernelName() {
+	return Int8KernelName(kernel);
+    }
+
+ protected:
+    int batchsize;
+    Int8Kernel kernel;
+    std::vector<int> dimensions;
+
+    // Per weighted layer: packed int8 weights, the scale turning a
+    // column's integer sums back into S, and the biases.
+    std::vector<std::vector<int8_t> > weights;
+    std::vector<std::vector<double> > scales, biases;
+
+    // Per layer: 7 bit activations, rows padded to a multiple of 4.
+    std::vector<std::vector<uint8_t> > activations;
+    std::vector<int32_t> sums;
+    double *output, *logits;
+};
+
+#endif
@@ -0,0 +1,94 @@
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include "mnist/mnist.h"
+#include "nn/predictor.h"
+
+// Load generator for Predictor. Serves the test set from a model saved
+// with distributed_nn --model_file:
+//
+//   predictor_load <model> [clients] [requests per client] [max batch] [max delay us]
+//
+// First one thread calls Predict for each image in turn, then `clients`
+// threads each Submit a request and wait for its answer, repeatedly.
+
+typedef std::chrono::steady_clock Clock;
+
+double Micros(Clock::time_point start, Clock::time_point end) {
+    return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+void Report(string name, std::vector<double> &latencies, double elapsed_us, int n_correct) {
+    std::sort(latencies.begin(), latencies.end());
+    int n = latencies.size();
+    std::cout << name << ": " << n << " requests, p50 " << latencies[n/2]
+	      << " us, p99 " << latencies[std::min(n-1, n*99/100)]
+	      << " us, " << n / (elapsed_us / 1e6) << " requests/s, accuracy "
+	      << n_correct / (double)n << std::endl;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+	std::cout << "Usage: " << argv[0] << " <model> [clients] [requests per client] [max batch] [max delay us]" << std::endl;
+	exit(-1);
+    }
+    string path = argv[1];
+    int n_clients = argc > 2 ? std::stoi(argv[2]) : 8;
+    int n_requests = argc > 3 ? std::stoi(argv[3]) : 1000;
+    int max_batch = argc > 4 ? std::stoi(argv[4]) : 32;
+    int max_delay_us = argc > 5 ? std::stoi(argv[5]) : 500;
+
+    std::cout << std::fixed << std::setprecision(2);
+
+    int n_images, n_labels, image_size;
+    uchar **images = read_mnist_images(TEST_IMAGES, n_images, image_size);
+    uchar *labels = read_mnist_labels(TEST_LABELS, n_labels);
+
+    ModelFile model(path);
+    NNParams *params = model.Params(max_batch);
+    Predictor *predictor = new Predictor(params, model, max_delay_us);
+
+    // One at a time, on this thread.
+    std::vector<double> latencies;
+    int n_correct = 0;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < n_requests; i++) {
+	int image = i % n_images;
+	Clock::time_point sent = Clock::now();
+	Prediction prediction = predictor->Predict(images[image]);
+	latencies.push_back(Micros(sent, Clock::now()));
+	n_correct += prediction.label == labels[image];
+    }
+    Report("Predict", latencies, Micros(start, Clock::now()), n_correct);
+
+    // Closed loop: each client has one request outstanding.
+    std::vector<std::vector<double> > client_latencies(n_clients);
+    std::atomic<int> n_batched_correct(0);
+    std::vector<std::thread> clients;
+    start = Clock::now();
+    for (int c = 0; c < n_clients; c++) {
+	clients.push_back(std::thread([&, c] {
+	    for (int i = 0; i < n_requests; i++) {
+		int image = (c * n_requests + i) % n_images;
+		Clock::time_point sent = Clock::now();
+		Prediction prediction = predictor->Submit(images[image]).get();
+		client_latencies[c].push_back(Micros(sent, Clock::now()));
+		n_batched_correct += prediction.label == labels[image];
+	    }
+	}));
+    }
+    for (int c = 0; c < n_clients; c++) {
+	clients[c].join();
+    }
+    double elapsed = Micros(start, Clock::now());
+    latencies.clear();
+    for (int c = 0; c < n_clients; c++) {
+	latencies.insert(latencies.end(), client_latencies[c].begin(), client_latencies[c].end());
+    }
+    Report("Submit x" + std::to_string(n_clients), latencies, elapsed, n_batched_correct);
+    predictor->PrintStats();
+
+    delete predictor;
+    delete params;
+}
@@ -15,7 +15,8 @@ def extract_time_losses(fname):
         if i == 0:
             name = line
         else:
-            step, time, loss, err = [float(x) for x in line.split(" ")]
+            # Subset evaluations append confidence intervals.
+            step, time, loss, err = [float(x) for x in line.split(" ")[:4]]
             times.append(time)
             losses.append(loss)
     f.close()
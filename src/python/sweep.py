@@ -0,0 +1,110 @@
+# Runs distributed_nn over a grid of rank counts, backup worker counts and
+# batch sizes, and collects throughput, step latency and time to a target
+# error rate into one table.
+#
+#   python src/python/sweep.py --ranks 6,8,10 --backups 0,2,4 --batch-sizes 64,128 \
+#       --iters 200 --target-error 0.2 --out sweep.csv
+#
+# Run from the directory distributed_nn reads data/ and writes outfiles/ in.
+import argparse
+import csv
+import glob
+import itertools
+import os
+import re
+import shutil
+import subprocess
+import sys
+
+STEP_TIME = re.compile(r"Master trained (\d+) steps in ([\d.]+) ms, ([\d.]+) ms per step")
+SAMPLES = re.compile(r"Master applied (\d+) gradients, ([\d.]+) samples per second")
+COLLECTING = re.compile(r"Collecting (\d+) of (\d+) workers")
+
+def parse_list(value):
+    return [int(x) for x in value.split(",")]
+
+def time_to_error(fname, target):
+    f = open(fname)
+    for i, line in enumerate(f):
+        if i == 0:
+            continue
+        step, time, loss, err = [float(x) for x in line.split(" ")[:4]]
+        if err <= target:
+            f.close()
+            return time
+    f.close()
+    return None
+
+def run(args, n_ranks, n_backups, batch_size):
+    for fname in glob.glob("outfiles/*_out_*"):
+        os.remove(fname)
+
+    command = ["mpirun", "-n", str(n_ranks)] + args.mpirun_args.split() + [args.binary]
+    if args.config:
+        command += ["--config", args.config]
+    command += ["--n_train_iters", str(args.iters),
+                "--n_backup_workers", str(n_backups),
+                "--batch_size", str(batch_size)]
+    print(" ".join(command))
+    sys.stdout.flush()
+    output = subprocess.run(command, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                            universal_newlines=True, errors="replace").stdout
+
+    run_name = "ranks%d_backups%d_batch%d" % (n_ranks, n_backups, batch_size)
+    run_dir = os.path.join(args.results_dir, run_name)
+    os.makedirs(run_dir, exist_ok=True)
+    with open(os.path.join(run_dir, "log.txt"), "w") as log:
+        log.write(output)
+    for fname in glob.glob("outfiles/*_out_*"):
+        shutil.copy(fname, run_dir)
+
+    # Taken from the run, which knows about micro_batches, master_computes
+    # and anything --config changed.
+    result = {"ranks": n_ranks, "backups": n_backups, "batch_size": batch_size,
+              "n_to_collect": "", "steps": "", "ms_per_step": "",
+              "samples_per_sec": "", "time_to_target_ms": ""}
+    match = COLLECTING.search(output)
+    if match:
+        result["n_to_collect"] = int(match.group(1))
+    match = STEP_TIME.search(output)
+    if match:
+        result["steps"] = int(match.group(1))
+        result["ms_per_step"] = "%.1f" % float(match.group(3))
+    match = SAMPLES.search(output)
+    if match:
+        result["samples_per_sec"] = "%.1f" % float(match.group(2))
+    for fname in glob.glob("outfiles/time_loss_out_*"):
+        time = time_to_error(fname, args.target_error)
+        if time is not None:
+            result["time_to_target_ms"] = "%.0f" % time
+    return result
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--ranks", type=parse_list, default=[8])
+parser.add_argument("--backups", type=parse_list, default=[0, 2, 4])
+parser.add_argument("--batch-sizes", type=parse_list, default=[128])
+parser.add_argument("--iters", type=int, default=100)
+parser.add_argument("--target-error", type=float, default=0.2)
+parser.add_argument("--binary", default="./distributed_nn")
+parser.add_argument("--config", default="")
+parser.add_argument("--mpirun-args", default="--allow-run-as-root --oversubscribe")
+parser.add_argument("--results-dir", default="sweep_results")
+parser.add_argument("--out", default="sweep.csv")
+args = parser.parse_args()
+
+results = []
+for n_ranks, n_backups, batch_size in itertools.product(args.ranks, args.backups, args.batch_sizes):
+    if n_ranks - 2 - n_backups < 1:
+        continue
+    results.append(run(args, n_ranks, n_backups, batch_size))
+
+fields = ["ranks", "backups", "batch_size", "n_to_collect", "steps",
+          "ms_per_step", "samples_per_sec", "time_to_target_ms"]
+with open(args.out, "w") as f:
+    writer = csv.DictWriter(f, fieldnames=fields)
+    writer.writeheader()
+    writer.writerows(results)
+
+print(" ".join("%16s" % field for field in fields))
+for result in results:
+    print(" ".join("%16s" % result[field] for field in fields))
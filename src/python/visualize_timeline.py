@@ -9,6 +9,7 @@ f = open(fname)
 
 master_times = {}
 worker_times = {}
+step_n_to_collect = {}
 steps = set()
 name = ""
 
@@ -16,11 +17,14 @@ for i, line in enumerate(f):
     if i == 0:
         name = line
     else:
-        time, step, is_master = (int(x) for x in line.split(" "))
+        # Step starts go on to list weight versions, gradients from
+        # workers given delays the source and its delays.
+        time, step, is_master, n_to_collect = (int(float(x)) for x in line.split(" ")[:4])
         steps.add(step)
         if is_master:
             assert(step not in master_times)
             master_times[step] = time
+            step_n_to_collect[step] = n_to_collect
         else:
             if step not in worker_times:
                 worker_times[step] = []
@@ -56,7 +60,7 @@ for i, step in enumerate(sorted(list(steps))):
         break
     count = len(worker_times[step])
     avg_gradients_received += count
-    print("Step: %d, NGradientsReceived: %d" % (step, count))
+    print("Step: %d, NGradientsReceived: %d, NToCollect: %d" % (step, count, step_n_to_collect[step]))
 avg_gradients_received /= float(len(list(steps))-1)
 
 print("Average number of gradients received per step: %f" % avg_gradients_received)
@@ -0,0 +1,123 @@
+#include <iostream>
+#include <iomanip>
+#include "distributed/distributed_defines.h"
+#include "distributed/scaling_simulator.h"
+
+// Predicts step time and master load of the parameter server at any
+// number of workers from the traces of a smaller run (see
+// distributed/scaling_simulator.h):
+//
+//   mpirun -n 6 distributed_nn --generate_timeline true ...
+//   simulator_nn outfiles/trace_out_* --timeline outfiles/timeline_out_<name> --workers 4,16,64 ...
+//
+// Other settings are distributed_nn's and mean the same here, so pass
+// the traced run's own (--config works too): n_train_iters,
+// n_to_collect, n_backup_workers, shortcircuit and the injected delays.
+//
+//   --workers N,...        workers to simulate (default as many as traced)
+//   --latency_us US        per message (default 5)
+//   --bandwidth_gbps GBIT  each way on the master's link, in Gb/s (default 80)
+//   --header_us US         the master's cost per gradient header (default 5)
+//   --seed N               for drawing recorded steps (default 1)
+//   --timeline FILE        the traced run's timeline, to compare with
+
+// Mean time between the master's step starts in a timeline, -1 if it
+// has fewer than two.
+double TimelineMillisPerStep(string path, int *n_to_collect) {
+    std::ifstream file(path);
+    string line;
+    if (!file.is_open() || !std::getline(file, line)) {
+	std::cout << "Invalid timeline file: " << path << std::endl;
+	exit(-1);
+    }
+    double first = 0, last = 0;
+    int n_starts = 0;
+    while (std::getline(file, line)) {
+	std::stringstream fields(line);
+	double time;
+	int step, is_master;
+	if (!(fields >> time >> step >> is_master >> *n_to_collect) || !is_master) continue;
+	if (n_starts++ == 0) first = time;
+	last = time;
+    }
+    return n_starts < 2 ? -1 : (last - first) / (n_starts - 1);
+}
+
+int main(int argc, char **argv) {
+    std::vector<string> traces;
+    std::vector<int> worker_counts;
+    NetworkModel network = {0.005, 80 * 1.25e5, 0.005};
+    unsigned seed = 1;
+    string timeline;
+
+    for (int i = 1; i < argc; i++) {
+	string arg = argv[i];
+	if (arg.compare(0, 2, "--") != 0) {
+	    traces.push_back(arg);
+	    continue;
+	}
+	string key = arg.substr(2), value;
+	size_t equals = key.find('=');
+	if (equals != string::npos) {
+	    value = key.substr(equals+1);
+	    key = key.substr(0, equals);
+	}
+	else if (i+1 < argc) {
+	    value = argv[++i];
+	}
+
+	if (key == "workers") {
+	    std::stringstream stream(value);
+	    string count;
+	    while (std::getline(stream, count, ',')) {
+		worker_counts.push_back(std::stoi(count));
+	    }
+	}
+	else if (key == "latency_us") network.latency_ms = std::stod(value) / 1000;
+	else if (key == "bandwidth_gbps") network.bytes_per_ms = std::stod(value) * 1.25e5;
+	else if (key == "header_us") network.header_ms = std::stod(value) / 1000;
+	else if (key == "seed") seed = std::stoi(value);
+	else if (key == "timeline") timeline = value;
+	else if (key == "config") run_config.Load(value);
+	else run_config.Set(key, value);
+    }
+
+    RecordedRun run;
+    for (int i = 0; i < traces.size(); i++) {
+	run.Load(traces[i]);
+    }
+    if (run.workers.empty() || run.n_master_steps == 0) {
+	std::cout << "Usage: " << argv[0] << " <master and worker trace files> [--workers N,...] [settings]" << std::endl;
+	exit(-1);
+    }
+    if (worker_counts.empty()) {
+	worker_counts.push_back(run.n_traced_workers);
+    }
+
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << "Traced " << run.n_traced_workers << " workers; master " << run.UpdateMillis()
+	      << " ms per update, " << run.MasterMillisPerStep() << " ms busy per step" << std::endl;
+    if (timeline != "") {
+	int n_to_collect = 0;
+	double millis_per_step = TimelineMillisPerStep(timeline, &n_to_collect);
+	if (millis_per_step <= 0) {
+	    std::cout << "Fewer than two steps in timeline " << timeline << std::endl;
+	    exit(-1);
+	}
+	std::cout << "Recorded " << run.n_traced_workers << " workers collecting " << n_to_collect << ": "
+		  << millis_per_step << " ms per step, master "
+		  << 100 * run.MasterMillisPerStep() / millis_per_step << "% busy" << std::endl;
+    }
+
+    for (int i = 0; i < worker_counts.size(); i++) {
+	int n_procs = worker_counts[i] + 2;
+	int n_to_collect = run_config.NToCollect(n_procs);
+	if (n_to_collect > worker_counts[i]) {
+	    std::cout << "n_to_collect " << n_to_collect << " exceeds " << worker_counts[i] << " workers" << std::endl;
+	    exit(-1);
+	}
+	ScalingSimulator simulator(run, network, worker_counts[i], n_to_collect, seed);
+	simulator.Run(run_config.n_train_iters);
+	simulator.Print();
+    }
+}
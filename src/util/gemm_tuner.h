@@ -0,0 +1,185 @@
+#ifndef _GEMM_TUNER_
+#define _GEMM_TUNER_
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <tuple>
+#include <chrono>
+#include <cstdio>
+#include <algorithm>
+#include <unistd.h>
+#include <cblas.h>
+#include "openblas_threads.h"
+
+enum GemmVariant { GEMM_NO_TRANS, GEMM_TRANS_A, GEMM_TRANS_B };
+
+// Chooses the BLAS thread count per gemm shape. A 128x785x500 product
+// wants every core while a 128x101x10 one runs fastest on one, so one
+// global setting suits neither.
+//
+// Shapes are recorded while the network runs a batch, then each is
+// timed at 1, 2, 4, ... threads up to the rank's budget and the fastest
+// kept (the fewest threads within 5% of it, to leave cores free). The
+// util.h wrappers switch BLAS to the chosen count before each gemm.
+// Results are cached in a file keyed by the budget, so later runs skip
+// the timing.
+class GemmTuner {
+ public:
+    typedef std::tuple<int, int, int, int> Shape;
+
+    GemmTuner() {
+	max_threads = current_threads = 0;
+	recording = false;
+    }
+
+    // Called by the gemm wrappers.
+    void Apply(GemmVariant variant, int m, int n, int k) {
+	if (recording) {
+	    shapes.insert(Shape(variant, m, n, k));
+	}
+	if (table.empty()) return;
+	std::map<Shape, int>::iterator entry = table.find(Shape(variant, m, n, k));
+	int threads = entry == table.end() ? max_threads : entry->second;
+	if (threads != current_threads) {
+	    openblas_set_num_threads(threads);
+	    current_threads = threads;
+	}
+    }
+
+    void StartRecording() {
+	recording = true;
+    }
+
+    void StopRecording() {
+	recording = false;
+    }
+
+    // Picks thread counts for the recorded shapes, reading and extending
+    // the cache at path.
+    void Tune(int max_threads, std::string path) {
+	StopRecording();
+	if (!openblas_set_num_threads) {
+	    std::cout << "Not tuning gemms: BLAS threads unmanaged" << std::endl;
+	    return;
+	}
+	this->max_threads = max_threads;
+	Load(path);
+
+	int n_tuned = 0, n_cached = 0;
+	for (std::set<Shape>::iterator shape = shapes.begin(); shape != shapes.end(); shape++) {
+	    std::tuple<int, int, int, int, int> key = CacheKey(*shape);
+	    if (cache.count(key)) {
+		n_cached++;
+	    }
+	    else {
+		cache[key] = Benchmark(*shape);
+		n_tuned++;
+	    }
+	    table[*shape] = cache[key];
+	}
+	if (n_tuned > 0) {
+	    Save(path);
+	}
+	openblas_set_num_threads(max_threads);
+	current_threads = max_threads;
+	std::cout << "Tuned " << n_tuned << " gemm shapes, " << n_cached << " from " << path << std::endl;
+    }
+
+    void Print() {
+	for (std::map<Shape, int>::iterator entry = table.begin(); entry != table.end(); entry++) {
+	    std::cout << "  " << VariantName(std::get<0>(entry->first)) << " " << std::get<1>(entry->first)
+		      << "x" << std::get<2>(entry->first) << "x" << std::get<3>(entry->first)
+		      << ": " << entry->second << " thread(s)" << std::endl;
+	}
+    }
+
+ protected:
+    int max_threads, current_threads;
+    bool recording;
+    std::set<Shape> shapes;
+    std::map<Shape, int> table;
+
+    // (max_threads, variant, m, n, k) -> threads
+    std::map<std::tuple<int, int, int, int, int>, int> cache;
+
+    std::tuple<int, int, int, int, int> CacheKey(Shape shape) {
+	return std::make_tuple(max_threads, std::get<0>(shape), std::get<1>(shape),
+			       std::get<2>(shape), std::get<3>(shape));
+    }
+
+    static std::string VariantName(int variant) {
+	return variant == GEMM_TRANS_A ? "TransA" : variant == GEMM_TRANS_B ? "TransB" : "NoTrans";
+    }
+
+    int Benchmark(Shape shape) {
+	int variant = std::get<0>(shape), m = std::get<1>(shape), n = std::get<2>(shape), k = std::get<3>(shape);
+	std::vector<double> A((size_t)m * k, .5), B((size_t)k * n, .5), C((size_t)m * n, 0);
+	CBLAS_TRANSPOSE trans_a = variant == GEMM_TRANS_A ? CblasTrans : CblasNoTrans;
+	CBLAS_TRANSPOSE trans_b = variant == GEMM_TRANS_B ? CblasTrans : CblasNoTrans;
+	int lda = variant == GEMM_TRANS_A ? m : k;
+	int ldb = variant == GEMM_TRANS_B ? k : n;
+
+	std::vector<int> candidates;
+	for (int threads = 1; threads < max_threads; threads *= 2) {
+	    candidates.push_back(threads);
+	}
+	candidates.push_back(max_threads);
+
+	std::vector<double> times;
+	for (int i = 0; i < candidates.size(); i++) {
+	    openblas_set_num_threads(candidates[i]);
+	    cblas_dgemm(CblasRowMajor, trans_a, trans_b, m, n, k, 1, A.data(), lda, B.data(), ldb, 1, C.data(), n);
+	    int reps = 0;
+	    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	    double elapsed = 0;
+	    while (reps < 3 || elapsed < 20) {
+		cblas_dgemm(CblasRowMajor, trans_a, trans_b, m, n, k, 1, A.data(), lda, B.data(), ldb, 1, C.data(), n);
+		reps++;
+		elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	    }
+	    times.push_back(elapsed / reps);
+	}
+
+	double best = *std::min_element(times.begin(), times.end());
+	for (int i = 0; i < candidates.size(); i++) {
+	    if (times[i] <= best * 1.05) return candidates[i];
+	}
+	return max_threads;
+    }
+
+    // One "max_threads variant m n k threads" line per shape.
+    void Load(std::string path) {
+	std::ifstream file(path);
+	std::string line;
+	while (std::getline(file, line)) {
+	    std::stringstream fields(line);
+	    int budget, variant, m, n, k, threads;
+	    if (fields >> budget >> variant >> m >> n >> k >> threads) {
+		cache[std::make_tuple(budget, variant, m, n, k)] = threads;
+	    }
+	}
+    }
+
+    // Written aside and renamed so ranks tuning at once never read half
+    // a file.
+    void Save(std::string path) {
+	std::string temporary = path + "." + std::to_string(getpid());
+	std::ofstream file(temporary);
+	for (std::map<std::tuple<int, int, int, int, int>, int>::iterator entry = cache.begin(); entry != cache.end(); entry++) {
+	    file << std::get<0>(entry->first) << " " << std::get<1>(entry->first) << " "
+		 << std::get<2>(entry->first) << " " << std::get<3>(entry->first) << " "
+		 << std::get<4>(entry->first) << " " << entry->second << std::endl;
+	}
+	file.close();
+	std::rename(temporary.c_str(), path.c_str());
+    }
+};
+
+GemmTuner gemm_tuner;
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef _INT8_GEMM_
+#define _INT8_GEMM_
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define INT8_GEMM_X86
+#include <immintrin.h>
+#endif
+
+// C = A*B for unsigned 7 bit activations A (m x k, row major) and
+// signed 8 bit weights B (k x n), summed exactly in int32. Activations
+// are kept below 128 so that AVX2's pairwise u8*s8 products never
+// saturate 16 bits; every path then gives bit for bit the same sums.
+//
+// B is packed for the VNNI dot product instruction: output columns in
+// groups of 16 and, within a group, the 16 columns' weights for 4
+// consecutive k next to each other (64 bytes, one zmm). A row's 4
+// activations for those k are broadcast and multiplied into all 16
+// columns at once, so each accumulator holds finished C entries and no
+// horizontal sums are needed. k is padded to a multiple of 4 and n to
+// a multiple of 16, with zeros.
+//
+// Int8ChooseKernel picks AVX-512 VNNI, AVX2 or plain loops for the CPU
+// we run on; off x86-64, or without GCC's target attributes, only the
+// plain loops are built.
+#ifndef INT8_GEMM_MR
+#define INT8_GEMM_MR 4
+#endif
+#define INT8_GEMM_GROUP 16
+
+inline int Int8Pad(int x, int multiple) {
+    return (x + multiple - 1) / multiple * multiple;
+}
+
+// Where B[p][j] goes in the packed layout of a k_pad x n_pad matrix.
+inline size_t Int8PackedIndex(int p, int j, int k_pad) {
+    return (size_t)(j / INT8_GEMM_GROUP) * k_pad * INT8_GEMM_GROUP
+	+ (p / 4) * 4 * INT8_GEMM_GROUP + (j % INT8_GEMM_GROUP) * 4 + p % 4;
+}
+
+inline int32_t Int8Broadcast(const uint8_t *a) {
+    int32_t word;
+    memcpy(&word, a, sizeof(word));
+    return word;
+}
+
+#ifdef INT8_GEMM_X86
+template <int MR, int NG>
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+void Int8BlockVNNI(const uint8_t *A, const int8_t *B, int32_t *C,
+		   int k_pad, int lda, int ldc) {
+    __m512i sums[MR][NG];
+    for (int r = 0; r < MR; r++) {
+	for (int g = 0; g < NG; g++) {
+	    sums[r][g] = _mm512_setzero_si512();
+	}
+    }
+    size_t group_stride = (size_t)k_pad * INT8_GEMM_GROUP;
+    for (int p = 0; p < k_pad; p += 4) {
+	__m512i b[NG];
+	for (int g = 0; g < NG; g++) {
+	    b[g] = _mm512_loadu_si512(&B[g * group_stride + p * INT8_GEMM_GROUP]);
+	}
+	for (int r = 0; r < MR; r++) {
+	    __m512i a = _mm512_set1_epi32(Int8Broadcast(&A[r * lda + p]));
+	    for (int g = 0; g < NG; g++) {
+		sums[r][g] = _mm512_dpbusd_epi32(sums[r][g], a, b[g]);
+	    }
+	}
+    }
+    for (int r = 0; r < MR; r++) {
+	for (int g = 0; g < NG; g++) {
+	    _mm512_storeu_si512(&C[r * ldc + g * INT8_GEMM_GROUP], sums[r][g]);
+	}
+    }
+}
+
+// u8*s8 pairs to s16 (exact for 7 bit activations), then pairs of
+// those to s32.
+template <int MR, int NG>
+__attribute__((target("avx2")))
+void Int8BlockAVX2(const uint8_t *A, const int8_t *B, int32_t *C,
+		   int k_pad, int lda, int ldc) {
+    __m256i sums[MR][2*NG];
+    for (int r = 0; r < MR; r++) {
+	for (int h = 0; h < 2*NG; h++) {
+	    sums[r][h] = _mm256_setzero_si256();
+	}
+    }
+    __m256i ones = _mm256_set1_epi16(1);
+    size_t group_stride = (size_t)k_pad * INT8_GEMM_GROUP;
+    for (int p = 0; p < k_pad; p += 4) {
+	__m256i b[2*NG];
+	for (int h = 0; h < 2*NG; h++) {
+	    b[h] = _mm256_loadu_si256((const __m256i *)&B[(h/2) * group_stride + p * INT8_GEMM_GROUP + (h%2) * 32]);
+	}
+	for (int r = 0; r < MR; r++) {
+	    __m256i a = _mm256_set1_epi32(Int8Broadcast(&A[r * lda + p]));
+	    for (int h = 0; h < 2*NG; h++) {
+		__m256i pairs = _mm256_maddubs_epi16(a, b[h]);
+		sums[r][h] = _mm256_add_epi32(sums[r][h], _mm256_madd_epi16(pairs, ones));
+	    }
+	}
+    }
+    for (int r = 0; r < MR; r++) {
+	for (int h = 0; h < 2*NG; h++) {
+	    _mm256_storeu_si256((__m256i *)&C[r * ldc + h * 8], sums[r][h]);
+	}
+    }
+}
+#endif
+
+template <int MR, int NG>
+void Int8BlockScalar(const uint8_t *A, const int8_t *B, int32_t *C,
+		     int k_pad, int lda, int ldc) {
+    size_t group_stride = (size_t)k_pad * INT8_GEMM_GROUP;
+    for (int r = 0; r < MR; r++) {
+	int32_t sums[NG * INT8_GEMM_GROUP] = {0};
+	for (int p = 0; p < k_pad; p += 4) {
+	    const uint8_t *a = &A[r * lda + p];
+	    for (int g = 0; g < NG; g++) {
+		const int8_t *b = &B[g * group_stride + p * INT8_GEMM_GROUP];
+		for (int c = 0; c < INT8_GEMM_GROUP; c++) {
+		    sums[g * INT8_GEMM_GROUP + c] += a[0] * b[c*4] + a[1] * b[c*4+1] + a[2] * b[c*4+2] + a[3] * b[c*4+3];
+		}
+	    }
+	}
+	memcpy(&C[r * ldc], sums, sizeof(sums));
+    }
+}
+
+enum Int8Kernel { INT8_SCALAR, INT8_AVX2, INT8_VNNI };
+
+inline Int8Kernel Int8ChooseKernel() {
+#ifdef INT8_GEMM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bw")) return INT8_VNNI;
+    if (__builtin_cpu_supports("avx2")) return INT8_AVX2;
+#endif
+    return INT8_SCALAR;
+}
+
+inline const char *Int8KernelName(Int8Kernel kernel) {
+    return kernel == INT8_VNNI ? "avx512-vnni" : kernel == INT8_AVX2 ? "avx2" : "scalar";
+}
+
+template <int MR, int NG>
+inline void Int8Block(Int8Kernel kernel, const uint8_t *A, const int8_t *B, int32_t *C,
+		      int k_pad, int lda, int ldc) {
+#ifdef INT8_GEMM_X86
+    if (kernel == INT8_VNNI) return Int8BlockVNNI<MR, NG>(A, B, C, k_pad, lda, ldc);
+    if (kernel == INT8_AVX2) return Int8BlockAVX2<MR, NG>(A, B, C, k_pad, lda, ldc);
+#endif
+    Int8BlockScalar<MR, NG>(A, B, C, k_pad, lda, ldc);
+}
+
+template <int MR>
+inline void Int8Rows(Int8Kernel kernel, const uint8_t *A, const int8_t *B, int32_t *C,
+		     int n_pad, int k_pad, int lda, int ldc) {
+    size_t group_stride = (size_t)k_pad * INT8_GEMM_GROUP;
+    int j = 0;
+    for (; j + 2*INT8_GEMM_GROUP <= n_pad; j += 2*INT8_GEMM_GROUP) {
+	Int8Block<MR, 2>(kernel, A, &B[(j / INT8_GEMM_GROUP) * group_stride], &C[j], k_pad, lda, ldc);
+    }
+    if (j < n_pad) {
+	Int8Block<MR, 1>(kernel, A, &B[(j / INT8_GEMM_GROUP) * group_stride], &C[j], k_pad, lda, ldc);
+    }
+}
+
+// C (m x n_pad, ldc) = A (m x k_pad, lda) * packed B.
+inline void Int8Gemm(Int8Kernel kernel, const uint8_t *A, const int8_t *B, int32_t *C,
+		     int m, int n_pad, int k_pad, int lda, int ldc) {
+    int i = 0;
+    for (; i + INT8_GEMM_MR <= m; i += INT8_GEMM_MR) {
+	Int8Rows<INT8_GEMM_MR>(kernel, &A[i * lda], B, &C[i * ldc], n_pad, k_pad, lda, ldc);
+    }
+    for (; i < m; i++) {
+	Int8Rows<1>(kernel, &A[i * lda], B, &C[i * ldc], n_pad, k_pad, lda, ldc);
+    }
+}
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef _OPENBLAS_THREADS_
+#define _OPENBLAS_THREADS_
+
+// Present when linked against OpenBLAS proper, NULL otherwise.
+extern "C" void openblas_set_num_threads(int n_threads) __attribute__((weak));
+extern "C" int openblas_get_num_threads() __attribute__((weak));
+
+#endif
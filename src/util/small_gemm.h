@@ -0,0 +1,100 @@
+#ifndef _SMALL_GEMM_
+#define _SMALL_GEMM_
+
+#include <algorithm>
+
+// Register blocked C += op(A)*op(B) for products too small to repay
+// cblas_dgemm's setup, packing and threading, such as the 101x10 and
+// 101x100 layers at the tail of the network. C is walked in MR x NR
+// blocks whose sums stay in registers for the whole k loop; the block
+// sizes are template arguments so the compiler unrolls and vectorizes
+// the block completely. With GCC or clang on x86-64 ELF the blocks are
+// compiled for AVX-512, AVX2 and plain x86-64 and picked at load time;
+// other toolchains compile them once, for the build's target.
+//
+// A is mxk (kxm with TRANS_A), B is kxn (nxk with TRANS_B), row major.
+#ifndef SMALL_GEMM_MR
+#define SMALL_GEMM_MR 4
+#endif
+#ifndef SMALL_GEMM_NR
+#define SMALL_GEMM_NR 4
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__) && defined(__ELF__)
+#define SMALL_GEMM_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define SMALL_GEMM_CLONES
+#endif
+
+template <bool TRANS_A>
+inline double SmallGemmA(const double *A, int i, int p, int lda) {
+    return TRANS_A ? A[p*lda+i] : A[i*lda+p];
+}
+
+template <bool TRANS_B>
+inline double SmallGemmB(const double *B, int p, int j, int ldb) {
+    return TRANS_B ? B[j*ldb+p] : B[p*ldb+j];
+}
+
+template <bool TRANS_A, bool TRANS_B, int MR, int NR>
+inline void SmallGemmBlock(const double *A, const double *B, double *C,
+			   int i, int j, int k,
+			   int lda, int ldb, int ldc) {
+    double sums[MR][NR] = {{0}};
+    for (int p = 0; p < k; p++) {
+	double b[NR];
+	for (int c = 0; c < NR; c++) {
+	    b[c] = SmallGemmB<TRANS_B>(B, p, j+c, ldb);
+	}
+	for (int r = 0; r < MR; r++) {
+	    double a = SmallGemmA<TRANS_A>(A, i+r, p, lda);
+	    for (int c = 0; c < NR; c++) {
+		sums[r][c] += a * b[c];
+	    }
+	}
+    }
+    for (int r = 0; r < MR; r++) {
+	for (int c = 0; c < NR; c++) {
+	    C[(i+r)*ldc+j+c] += sums[r][c];
+	}
+    }
+}
+
+template <bool TRANS_A, bool TRANS_B>
+inline void SmallGemmEdge(const double *A, const double *B, double *C,
+			  int i, int j, int mr, int nr, int k,
+			  int lda, int ldb, int ldc) {
+    for (int r = 0; r < mr; r++) {
+	for (int c = 0; c < nr; c++) {
+	    double sum = 0;
+	    for (int p = 0; p < k; p++) {
+		sum += SmallGemmA<TRANS_A>(A, i+r, p, lda) * SmallGemmB<TRANS_B>(B, p, j+c, ldb);
+	    }
+	    C[(i+r)*ldc+j+c] += sum;
+	}
+    }
+}
+
+template <bool TRANS_A, bool TRANS_B>
+SMALL_GEMM_CLONES
+void SmallGemm(const double *A, const double *B, double *C,
+	       int m, int n, int k,
+	       int lda, int ldb, int ldc) {
+    for (int i = 0; i < m; i += SMALL_GEMM_MR) {
+	int mr = std::min(SMALL_GEMM_MR, m-i);
+	for (int j = 0; j < n; j += SMALL_GEMM_NR) {
+	    int nr = std::min(SMALL_GEMM_NR, n-j);
+	    if (mr == SMALL_GEMM_MR && nr == SMALL_GEMM_NR) {
+		SmallGemmBlock<TRANS_A, TRANS_B, SMALL_GEMM_MR, SMALL_GEMM_NR>(A, B, C, i, j, k, lda, ldb, ldc);
+	    }
+	    else if (mr == SMALL_GEMM_MR && nr == 2) {
+		SmallGemmBlock<TRANS_A, TRANS_B, SMALL_GEMM_MR, 2>(A, B, C, i, j, k, lda, ldb, ldc);
+	    }
+	    else {
+		SmallGemmEdge<TRANS_A, TRANS_B>(A, B, C, i, j, mr, nr, k, lda, ldb, ldc);
+	    }
+	}
+    }
+}
+
+#endif
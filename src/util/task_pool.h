@@ -0,0 +1,297 @@
+#ifndef _TASK_POOL_
+#define _TASK_POOL_
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <sched.h>
+#include <unistd.h>
+
+// Loops shorter than this many elements (or rows of that many elements)
+// are not worth waking threads for and run on the caller.
+#ifndef TASK_POOL_GRAIN
+#define TASK_POOL_GRAIN 16384
+#endif
+
+// A thread spins this long for new tasks before going to sleep, so a
+// layer's loops back to back keep the pool awake but the cores are free
+// again for BLAS soon after.
+#ifndef TASK_POOL_SPIN_US
+#define TASK_POOL_SPIN_US 50
+#endif
+
+// Work-stealing threads for the elementwise and reduction loops of the
+// layers, the batch loader and the master's gradient sums.
+//
+// Until Start() there are no threads and every loop runs on its caller.
+// Start() takes the rank's cpus (see thread_budget.h) and starts a thread
+// on each but the first, left to the caller, pinned and ordered by NUMA
+// node. ParallelFor() cuts a range into chunks, deals them out to the
+// threads' deques in contiguous blocks and then works on them itself;
+// a thread pops from the back of its own deque and, once that is empty,
+// steals from the front of the others', those on its own node first.
+//
+// The pool runs alongside BLAS on the same cpus rather than on cpus of
+// its own: the loops and the gemms of a thread come one after the other,
+// and the pool sleeps between loops. Tasks therefore must not call BLAS
+// themselves, and a loop started inside a task runs inline. Any thread
+// may start loops, several at once.
+class TaskPool {
+ public:
+    TaskPool() {
+	n_pending = 0;
+	stopping = false;
+	n_loops = n_parallel_loops = n_steals = 0;
+    }
+
+    ~TaskPool() {
+	Stop();
+    }
+
+    void Start(std::vector<int> cpus) {
+	Stop();
+	std::vector<std::pair<int, int> > by_node;
+	for (size_t i = 0; i < cpus.size(); i++) {
+	    by_node.push_back(std::make_pair(NodeOf(cpus[i]), i));
+	}
+	std::stable_sort(by_node.begin(), by_node.end());
+	stopping = false;
+	for (size_t i = 1; i < by_node.size(); i++) {
+	    queues.push_back(new Queue());
+	    queues.back()->node = by_node[i].first;
+	    queues.back()->cpu = cpus[by_node[i].second];
+	}
+	for (size_t i = 0; i < queues.size(); i++) {
+	    threads.push_back(std::thread(&TaskPool::WorkerLoop, this, i));
+	}
+    }
+
+    void Stop() {
+	{
+	    std::lock_guard<std::mutex> lock(sleep_mutex);
+	    stopping = true;
+	}
+	sleep_cv.notify_all();
+	for (size_t i = 0; i < threads.size(); i++) {
+	    threads[i].join();
+	}
+	for (size_t i = 0; i < queues.size(); i++) {
+	    delete queues[i];
+	}
+	threads.clear();
+	queues.clear();
+    }
+
+    // Threads working on a loop, the caller included.
+    int NThreads() {
+	return queues.size() + 1;
+    }
+
+    // body(lo, hi) for pieces of [begin, end) of at least grain.
+    template <typename Body>
+    void ParallelFor(long begin, long end, long grain, Body body) {
+	n_loops++;
+	long n = end - begin;
+	grain = std::max(grain, 1L);
+	if (queues.empty() || in_task || n < 2 * grain) {
+	    if (n > 0) body(begin, end);
+	    return;
+	}
+	long chunk = std::max(grain, n / (NThreads() * CHUNKS_PER_THREAD));
+	Run(begin, end, chunk, [&body](long lo, long hi, int) { body(lo, hi); });
+    }
+
+    // Sums body(lo, hi) over pieces of [begin, end) with combine. The
+    // pieces depend only on the range and grain, and are combined in
+    // order, so the result does not change with the number of threads.
+    template <typename T, typename Body, typename Combine>
+    T ParallelReduce(long begin, long end, long grain, T identity, Body body, Combine combine) {
+	n_loops++;
+	long n = end - begin;
+	grain = std::max(grain, 1L);
+	long n_chunks = (n + grain - 1) / grain;
+	std::vector<T> partials(std::max(n_chunks, 0L), identity);
+	if (queues.empty() || in_task || n_chunks < 2) {
+	    for (long c = 0; c < n_chunks; c++) {
+		partials[c] = body(begin + c * grain, std::min(end, begin + (c+1) * grain));
+	    }
+	}
+	else {
+	    Run(begin, end, grain, [&body, &partials](long lo, long hi, int c) { partials[c] = body(lo, hi); });
+	}
+	T result = identity;
+	for (long c = 0; c < n_chunks; c++) {
+	    result = combine(result, partials[c]);
+	}
+	return result;
+    }
+
+    void Print() {
+	std::cout << "Task pool: " << NThreads() << " thread(s), " << n_parallel_loops << " of "
+		  << n_loops << " loops split, " << n_steals << " tasks stolen" << std::endl;
+    }
+
+ protected:
+    static const int CHUNKS_PER_THREAD = 4;
+
+    struct Job {
+	std::function<void(long, long, int)> body;
+	std::atomic<long> remaining;
+    };
+
+    struct Task {
+	Job *job;
+	long lo, hi;
+	int chunk;
+    };
+
+    struct Queue {
+	std::mutex mutex;
+	std::deque<Task> tasks;
+	int node, cpu;
+    };
+
+    std::vector<Queue *> queues;
+    std::vector<std::thread> threads;
+    std::atomic<long> n_pending;
+
+    // Guarded by sleep_mutex.
+    std::mutex sleep_mutex;
+    std::condition_variable sleep_cv;
+    bool stopping;
+
+    std::atomic<long> n_loops, n_parallel_loops, n_steals;
+
+    static thread_local bool in_task;
+
+    // Deal [begin, end) out in chunks and help until all have run.
+    void Run(long begin, long end, long chunk, std::function<void(long, long, int)> body) {
+	n_parallel_loops++;
+	Job job;
+	job.body = body;
+	long n_chunks = (end - begin + chunk - 1) / chunk;
+	job.remaining = n_chunks;
+	long per_queue = (n_chunks + queues.size() - 1) / queues.size();
+	for (int q = 0; q < (int)queues.size(); q++) {
+	    std::lock_guard<std::mutex> lock(queues[q]->mutex);
+	    for (long c = q * per_queue; c < std::min(n_chunks, (q+1) * per_queue); c++) {
+		queues[q]->tasks.push_back({&job, begin + c * chunk, std::min(end, begin + (c+1) * chunk), (int)c});
+	    }
+	}
+	n_pending += n_chunks;
+	{
+	    std::lock_guard<std::mutex> lock(sleep_mutex);
+	}
+	sleep_cv.notify_all();
+
+	// Take this job's chunks from the fronts, i.e. the ends the owning
+	// threads reach last.
+	int start = 0;
+	while (job.remaining > 0) {
+	    Task task;
+	    if (StealFrom(start, &job, &task)) {
+		Execute(task);
+	    }
+	    else {
+		std::this_thread::yield();
+	    }
+	    start = (start + 1) % queues.size();
+	}
+    }
+
+    // The first task of job in any queue, starting with queue start.
+    bool StealFrom(int start, Job *job, Task *task) {
+	for (size_t i = 0; i < queues.size(); i++) {
+	    Queue *queue = queues[(start + i) % queues.size()];
+	    std::lock_guard<std::mutex> lock(queue->mutex);
+	    for (std::deque<Task>::iterator it = queue->tasks.begin(); it != queue->tasks.end(); it++) {
+		if (it->job == job) {
+		    *task = *it;
+		    queue->tasks.erase(it);
+		    return true;
+		}
+	    }
+	}
+	return false;
+    }
+
+    bool PopOwn(int q, Task *task) {
+	std::lock_guard<std::mutex> lock(queues[q]->mutex);
+	if (queues[q]->tasks.empty()) return false;
+	*task = queues[q]->tasks.back();
+	queues[q]->tasks.pop_back();
+	return true;
+    }
+
+    // Thieves look at the queues of their own node first.
+    bool Steal(int q, Task *task) {
+	for (int pass = 0; pass < 2; pass++) {
+	    for (size_t i = 1; i < queues.size(); i++) {
+		int victim = (q + i) % queues.size();
+		if ((queues[victim]->node == queues[q]->node) != (pass == 0)) continue;
+		std::lock_guard<std::mutex> lock(queues[victim]->mutex);
+		if (queues[victim]->tasks.empty()) continue;
+		*task = queues[victim]->tasks.front();
+		queues[victim]->tasks.pop_front();
+		n_steals++;
+		return true;
+	    }
+	}
+	return false;
+    }
+
+    void Execute(Task &task) {
+	n_pending--;
+	in_task = true;
+	task.job->body(task.lo, task.hi, task.chunk);
+	in_task = false;
+	task.job->remaining--;
+    }
+
+    void WorkerLoop(int q) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(queues[q]->cpu, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+
+	std::chrono::steady_clock::time_point idle_since = std::chrono::steady_clock::now();
+	while (true) {
+	    Task task;
+	    if (PopOwn(q, &task) || Steal(q, &task)) {
+		Execute(task);
+		idle_since = std::chrono::steady_clock::now();
+		continue;
+	    }
+	    if (std::chrono::steady_clock::now() - idle_since < std::chrono::microseconds(TASK_POOL_SPIN_US)) {
+		std::this_thread::yield();
+		continue;
+	    }
+	    std::unique_lock<std::mutex> lock(sleep_mutex);
+	    sleep_cv.wait(lock, [this] { return stopping || n_pending > 0; });
+	    if (stopping) return;
+	    idle_since = std::chrono::steady_clock::now();
+	}
+    }
+
+    static int NodeOf(int cpu) {
+	for (int node = 0; node < 64; node++) {
+	    std::string path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpu" + std::to_string(cpu);
+	    if (access(path.c_str(), F_OK) == 0) return node;
+	}
+	return 0;
+    }
+};
+
+thread_local bool TaskPool::in_task = false;
+
+TaskPool task_pool;
+
+#endif